@@ -0,0 +1,172 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bottleneck.h"
+
+  // RED parameters
+static const double red_weight = 0.002;
+static const double red_maxp = 0.1;
+
+  // CODEL parameters, in seconds
+static const double codel_target = 0.005;
+static const double codel_interval = 0.100;
+
+  // typical packet size, used to scale RED drops and as the smallest
+  // backlog CODEL will drop at
+static const size_t mtu = 1500;
+
+Bottleneck::Bottleneck(int policy, size_t limit)
+{
+    struct timespec now;
+
+    policy_ = policy;
+    limit_ = limit;
+    bytes_ = 0;
+    drops_ = 0;
+    avg_ = 0;
+    count_ = -1;
+    first_above_ = 0;
+    drop_next_ = 0;
+    dropping_ = 0;
+    drop_count_ = 0;
+
+    clock_gettime(CLOCK_REALTIME,&now);
+    seed_[0] = now.tv_nsec;
+    seed_[1] = now.tv_nsec >> 16;
+    seed_[2] = getpid();
+}
+
+int
+Bottleneck::admit(struct timespec *now, double sojourn, size_t size)
+{
+    double t;
+    int ok;
+
+    t = now->tv_sec + (double) now->tv_nsec / 1000000000;
+
+      // forget chunks that have left the queue
+    while (!queue_.empty() && queue_.front().finish <= t) {
+	bytes_ -= queue_.front().size;
+	queue_.pop_front();
+    }
+
+    if (bytes_ + size > limit_)
+	ok = 0;
+    else if (policy_ == RED)
+	ok = red(size);
+    else if (policy_ == CODEL)
+	ok = codel(t,sojourn);
+    else
+	ok = 1;
+
+    if (!ok)
+	drops_++;
+    return ok;
+}
+
+void
+Bottleneck::enqueue(struct timespec *finish, size_t size)
+{
+    entry e;
+
+    e.finish = finish->tv_sec + (double) finish->tv_nsec / 1000000000;
+    e.size = size;
+    queue_.push_back(e);
+    bytes_ += size;
+}
+
+void
+Bottleneck::dequeue(struct timespec *finish, size_t size)
+{
+    std::deque<entry>::reverse_iterator i;
+    double t;
+
+      // the chunk is most likely the last, unless others have joined
+      // since; one that has already left is no longer counted
+    t = finish->tv_sec + (double) finish->tv_nsec / 1000000000;
+    for (i = queue_.rbegin(); i != queue_.rend(); i++) {
+	if (i->finish != t)
+	    continue;
+	if (size > i->size)
+	    size = i->size;
+	i->size -= size;
+	bytes_ -= size;
+	break;
+    }
+}
+
+int
+Bottleneck::red(size_t size)
+{
+    double minth, maxth, pb, pa;
+
+    minth = limit_ / 4;
+    maxth = 3 * minth;
+    avg_ = (1 - red_weight) * avg_ + red_weight * bytes_;
+    if (avg_ < minth) {
+	count_ = -1;
+	return 1;
+    }
+    if (avg_ >= maxth) {
+	count_ = 0;
+	return 0;
+    }
+
+      // space drops out evenly, using the count since the last drop
+    count_++;
+    pb = red_maxp * (avg_ - minth) / (maxth - minth);
+    pb = pb * size / mtu;
+    if (count_ * pb >= 1)
+	pa = 1;
+    else
+	pa = pb / (1 - count_ * pb);
+    if (erand48(seed_) < pa) {
+	count_ = 0;
+	return 0;
+    }
+    return 1;
+}
+
+int
+Bottleneck::codel(double now, double sojourn)
+{
+    int above;
+
+      // has the delay been above target for a full interval?
+    above = 0;
+    if (sojourn < codel_target || bytes_ <= mtu) {
+	first_above_ = 0;
+    } else if (first_above_ == 0) {
+	first_above_ = now + codel_interval;
+    } else if (now >= first_above_) {
+	above = 1;
+    }
+
+    if (dropping_) {
+	if (!above) {
+	    dropping_ = 0;
+	    return 1;
+	}
+	if (now < drop_next_)
+	    return 1;
+	drop_count_++;
+	drop_next_ += codel_interval / sqrt(drop_count_);
+	return 0;
+    }
+
+    if (above) {
+	  // start dropping, and remember the rate if we only just stopped
+	dropping_ = 1;
+	if (drop_count_ > 2 && now - drop_next_ < 8 * codel_interval)
+	    drop_count_ -= 2;
+	else
+	    drop_count_ = 1;
+	drop_next_ = now + codel_interval / sqrt(drop_count_);
+	return 0;
+    }
+    return 1;
+}
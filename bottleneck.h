@@ -0,0 +1,84 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef bottleneck_h
+#define bottleneck_h
+
+#include <stddef.h>
+#include <time.h>
+
+#include <deque>
+
+// A Bottleneck emulates the buffer of the router in front of a slow
+// link.  Data the limiter has scheduled but not yet sent is treated
+// as queued in this buffer, and each new chunk is either admitted or
+// dropped by an active queue management policy:
+
+// DROPTAIL drops a chunk when it would overflow the buffer.
+
+// RED (random early detection) drops chunks with a probability that
+// grows with the average queue length, between a quarter and three
+// quarters of the buffer.
+
+// CODEL (controlled delay) drops chunks once the queueing delay has
+// stayed above 5 ms for 100 ms, dropping more often the longer the
+// delay persists.
+
+// Because the limiter knows when a chunk will leave the queue as soon
+// as it is scheduled, the queueing delay is measured on arrival
+// rather than on departure.  RED and CODEL also drop-tail when the
+// buffer is full.  A Bottleneck is not thread safe; the rate limiter
+// only calls it while holding its own lock.
+
+class Bottleneck {
+ public:
+    enum { DROPTAIL, RED, CODEL };
+
+      // Create a queue with a policy and a buffer size in bytes.
+    Bottleneck(int,size_t);
+
+      // Decide whether a chunk may join the queue, given the current
+      // time, how long it will wait before being sent, and its size.
+      // Returns 1 if it is admitted, otherwise 0.
+    int admit(struct timespec*,double,size_t);
+
+      // Record an admitted chunk, which leaves the queue at the time
+      // given.
+    void enqueue(struct timespec*,size_t);
+
+      // Take back bytes of a chunk that leaves the queue at the time
+      // given, when they were admitted but not sent.
+    void dequeue(struct timespec*,size_t);
+
+      // Get the number of bytes queued and the number of drops.
+    inline size_t backlog() { return bytes_; }
+    inline unsigned long drops() { return drops_; }
+
+ private:
+    struct entry {
+	double finish;
+	size_t size;
+    };
+
+    int red(size_t);
+    int codel(double,double);
+
+    int policy_;
+    size_t limit_;
+    size_t bytes_;
+    unsigned long drops_;
+    std::deque<entry> queue_;
+    unsigned short seed_[3];
+
+      // RED state
+    double avg_;
+    int count_;
+
+      // CODEL state
+    double first_above_;
+    double drop_next_;
+    int dropping_;
+    int drop_count_;
+};
+
+#endif /*bottleneck_h*/
@@ -0,0 +1,190 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "concurrency.h"
+
+  // how often to adapt, and how many samples a window needs
+static const int64_t window = 100000000;
+static const int min_samples = 10;
+
+  // weights for the long-term average and for smoothing the limit
+static const double long_weight = 0.05;
+static const double smoothing = 0.2;
+
+static int64_t
+now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME,&t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+ConcurrencyLimit::ConcurrencyLimit(int initial, int max)
+{
+    max_ = (max > 0) ? max : INT_MAX;
+    limit_ = (initial > 0) ? initial : 1;
+    if (limit_ > max_)
+	limit_ = max_;
+    inflight_ = 0;
+    waiters_ = 0;
+    seq_ = 0;
+    stopped_ = 0;
+    sum_ = 0;
+    count_ = 0;
+    window_ = now() + window;
+    adapting_ = 0;
+    longrtt_ = 0;
+    estimate_ = limit_;
+}
+
+int
+ConcurrencyLimit::acquire(int block)
+{
+    int n, seq;
+
+    while (1) {
+	  // take a slot if there is one
+	n = __atomic_load_n(&inflight_,__ATOMIC_SEQ_CST);
+	while (n < __atomic_load_n(&limit_,__ATOMIC_RELAXED))
+	    if (__atomic_compare_exchange_n(&inflight_,&n,n + 1,1,
+					    __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST))
+		return 0;
+	if (!block) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+	if (__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST)) {
+	    errno = ECANCELED;
+	    return -1;
+	}
+
+	  // sleep until a slot is released; check again after saying
+	  // that we are waiting, in case one was released meanwhile
+	seq = __atomic_load_n(&seq_,__ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&waiters_,1,__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&inflight_,__ATOMIC_SEQ_CST) >=
+	    __atomic_load_n(&limit_,__ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST))
+	    syscall(SYS_futex,&seq_,FUTEX_WAIT_PRIVATE,seq,NULL,NULL,0);
+	__atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
+    }
+}
+
+void
+ConcurrencyLimit::release(int64_t latency)
+{
+    __atomic_fetch_sub(&inflight_,1,__ATOMIC_SEQ_CST);
+    if (latency >= 0)
+	sample(latency);
+    wake(1);
+}
+
+void
+ConcurrencyLimit::stop()
+{
+    __atomic_store_n(&stopped_,1,__ATOMIC_SEQ_CST);
+    wake(INT_MAX);
+}
+
+int
+ConcurrencyLimit::limit()
+{
+    return __atomic_load_n(&limit_,__ATOMIC_RELAXED);
+}
+
+int
+ConcurrencyLimit::inflight()
+{
+    return __atomic_load_n(&inflight_,__ATOMIC_RELAXED);
+}
+
+void
+ConcurrencyLimit::wake(int n)
+{
+    if (__atomic_load_n(&waiters_,__ATOMIC_SEQ_CST) == 0)
+	return;
+    __atomic_fetch_add(&seq_,1,__ATOMIC_SEQ_CST);
+    syscall(SYS_futex,&seq_,FUTEX_WAKE_PRIVATE,n,NULL,NULL,0);
+}
+
+void
+ConcurrencyLimit::sample(int64_t latency)
+{
+    int64_t t;
+    int busy;
+
+    __atomic_fetch_add(&sum_,latency,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&count_,1,__ATOMIC_RELAXED);
+
+      // one thread adapts at the end of each window
+    t = now();
+    if (t < __atomic_load_n(&window_,__ATOMIC_RELAXED) ||
+	__atomic_load_n(&count_,__ATOMIC_RELAXED) < min_samples)
+	return;
+    busy = 0;
+    if (!__atomic_compare_exchange_n(&adapting_,&busy,1,0,__ATOMIC_ACQUIRE,
+				     __ATOMIC_RELAXED))
+	return;
+    adapt(t);
+    __atomic_store_n(&adapting_,0,__ATOMIC_RELEASE);
+}
+
+void
+ConcurrencyLimit::adapt(int64_t t)
+{
+    double shortrtt, gradient, queue, next;
+    int64_t sum, count;
+    int old, limit;
+
+    sum = __atomic_exchange_n(&sum_,0,__ATOMIC_RELAXED);
+    count = __atomic_exchange_n(&count_,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&window_,t + window,__ATOMIC_RELAXED);
+    if (count == 0)
+	return;
+    shortrtt = (double) sum / count;
+
+      // the long-term average stands for latency without load; let it
+      // come down quickly once load has gone away
+    if (longrtt_ == 0)
+	longrtt_ = shortrtt;
+    else
+	longrtt_ = (1 - long_weight) * longrtt_ + long_weight * shortrtt;
+    if (longrtt_ > 2 * shortrtt)
+	longrtt_ *= 0.95;
+
+      // an application that does not use its limit learns nothing
+      // about whether it could use more
+    old = __atomic_load_n(&limit_,__ATOMIC_RELAXED);
+    if (__atomic_load_n(&inflight_,__ATOMIC_RELAXED) < old / 2)
+	return;
+
+    gradient = longrtt_ / shortrtt;
+    if (gradient > 1)
+	gradient = 1;
+    if (gradient < 0.5)
+	gradient = 0.5;
+    queue = sqrt(estimate_);
+    if (queue < 1)
+	queue = 1;
+    next = estimate_ * gradient + queue;
+    estimate_ = (1 - smoothing) * estimate_ + smoothing * next;
+    if (estimate_ < 1)
+	estimate_ = 1;
+    if (estimate_ > max_)
+	estimate_ = max_;
+
+    limit = (int) estimate_;
+    __atomic_store_n(&limit_,limit,__ATOMIC_RELAXED);
+    if (limit > old)
+	wake(limit - old);
+}
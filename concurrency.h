@@ -0,0 +1,67 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef concurrency_h
+#define concurrency_h
+
+#include <stdint.h>
+
+// A ConcurrencyLimit bounds how many operations may be in flight at
+// once.  It is a semaphore kept in a few atomic words, so taking and
+// releasing a slot takes no lock, and a thread that must wait sleeps
+// on a futex until a slot is released.
+
+// The bound adapts to measured latency, in the manner of a gradient
+// concurrency limiter.  A long-term average of latency stands for the
+// latency without load.  Once per window, the limit is scaled by the
+// ratio of that average to the latency just measured, between 0.5 and
+// 1, and a small queue allowance is added.  When latency rises, the
+// limit shrinks, so that extra operations wait here instead of piling
+// up behind a slow socket.  When latency is steady, the queue allowance
+// lets the limit creep up each window.  By Little's law, this keeps
+// the number in flight near throughput times the latency without load.
+
+class ConcurrencyLimit {
+ public:
+      // Create a limit with an initial and a maximum bound.
+    ConcurrencyLimit(int,int);
+
+      // Take a slot, waiting for one if need be, unless told not to
+      // block.  Returns 0 on success, otherwise -1 and errno is set to
+      // EAGAIN, or to ECANCELED once the limit is stopped.
+    int acquire(int);
+
+      // Wake every thread waiting for a slot and turn away any that
+      // would wait from now on.
+    void stop();
+
+      // Release a slot, giving the latency of the operation in
+      // nanoseconds, or a negative latency if it should not be
+      // measured.
+    void release(int64_t);
+
+      // Get the current bound and the number in flight.
+    int limit();
+    int inflight();
+
+ private:
+    void sample(int64_t);
+    void adapt(int64_t);
+    void wake(int);
+
+    int limit_;
+    int max_;
+    int inflight_;
+    int waiters_;
+    int seq_;
+    int stopped_;
+
+    int64_t sum_;
+    int64_t count_;
+    int64_t window_;
+    int adapting_;
+    double longrtt_;
+    double estimate_;
+};
+
+#endif /*concurrency_h*/
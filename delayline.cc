@@ -0,0 +1,528 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "delayline.h"
+#include "timespec.h"
+
+using namespace std;
+
+DelayLine::DelayLine()
+{
+    struct timespec now;
+
+    pthread_mutex_init(&mutex_,NULL);
+    wake_ = -1;
+    started_ = 0;
+    stop_ = 0;
+    delay_ = 0;
+    jitter_ = 0;
+    dist_ = UNIFORM;
+    maxhold_ = 1 << 20;
+    seq_ = 0;
+
+    clock_gettime(CLOCK_REALTIME,&now);
+    seed_[0] = now.tv_nsec;
+    seed_[1] = now.tv_nsec >> 16;
+    seed_[2] = getpid();
+}
+
+DelayLine::~DelayLine()
+{
+    map<int,endpoint>::iterator i;
+    uint64_t one;
+
+    pthread_mutex_lock(&mutex_);
+    stop_ = 1;
+    pthread_mutex_unlock(&mutex_);
+    if (started_) {
+	one = 1;
+	write(wake_,&one,sizeof(one));
+	pthread_join(thread_,NULL);
+    }
+    if (wake_ >= 0)
+	::close(wake_);
+
+    while (!outbox_.empty()) {
+	delete[] outbox_.top()->data;
+	delete outbox_.top();
+	outbox_.pop();
+    }
+    for (i = endpoints_.begin(); i != endpoints_.end(); i++) {
+	while (!i->second.inbox.empty()) {
+	    delete[] i->second.inbox.front()->data;
+	    delete i->second.inbox.front();
+	    i->second.inbox.pop_front();
+	}
+	while (!i->second.ready.empty()) {
+	    delete[] i->second.ready.front()->data;
+	    delete i->second.ready.front();
+	    i->second.ready.pop_front();
+	}
+	if (i->second.closing)
+	    ::close(i->first);
+    }
+    pthread_mutex_destroy(&mutex_);
+}
+
+void
+DelayLine::set_delay(int delay, int jitter, int dist)
+{
+    pthread_mutex_lock(&mutex_);
+    delay_ = (double) delay / 1000000;
+    jitter_ = (double) jitter / 1000000;
+    dist_ = dist;
+    pthread_mutex_unlock(&mutex_);
+}
+
+ssize_t
+DelayLine::send(int s, const void *buf, size_t len, int flags)
+{
+    endpoint *ep;
+    uint64_t one;
+    chunk *c;
+    int error;
+
+    pthread_mutex_lock(&mutex_);
+    ep = &endpoints_[s];
+
+      // report the error of an earlier delayed send
+    if (ep->error) {
+	error = ep->error;
+	ep->error = 0;
+	release(s);
+	pthread_mutex_unlock(&mutex_);
+	errno = error;
+	return -1;
+    }
+
+      // without a delay, send directly unless data is still queued
+    if (delay_ == 0 && jitter_ == 0 && ep->pending == 0) {
+	release(s);
+	pthread_mutex_unlock(&mutex_);
+	return ::send(s,buf,len,flags);
+    }
+
+    c = new chunk;
+    c->data = new char[len];
+    memcpy(c->data,buf,len);
+    c->len = len;
+    c->off = 0;
+    c->fd = s;
+    c->flags = flags;
+    c->error = 0;
+    c->seq = seq_++;
+    stamp(ep,&c->due);
+    ep->pending++;
+    outbox_.push(c);
+
+    if (!started_) {
+	wake_ = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (wake_ >= 0 && pthread_create(&thread_,NULL,run,this) == 0)
+	    started_ = 1;
+    }
+
+      // the sender sleeps until the earliest chunk is due, so it only
+      // needs waking when this one is earlier
+    if (started_ && outbox_.top() == c) {
+	one = 1;
+	write(wake_,&one,sizeof(one));
+    }
+    pthread_mutex_unlock(&mutex_);
+    return len;
+}
+
+ssize_t
+DelayLine::recv(int s, void *buf, size_t len, int flags)
+{
+    struct timespec now, wait;
+    struct pollfd pfd;
+    char data[65536];
+    endpoint *ep;
+    chunk *c;
+    size_t total, size, i;
+    ssize_t n;
+    int error, reading, peek;
+
+    peek = flags & MSG_PEEK;
+    pthread_mutex_lock(&mutex_);
+    while (1) {
+	ep = &endpoints_[s];
+	if (ep->datagram < 0)
+	    ep->datagram = datagram(s);
+	clock_gettime(CLOCK_REALTIME,&now);
+
+	  // hand over whatever is due; a peek leaves it held, and looks
+	  // past it instead
+	total = 0;
+	i = 0;
+	while (total < len && i < ep->inbox.size()) {
+	    c = ep->inbox[i];
+	    if (timespec_before(&now,&c->due))
+		break;
+	    if (c->len == 0 && (c->error || !ep->datagram)) {
+		  // end of stream or error, after any data before it
+		if (total > 0)
+		    break;
+		error = c->error;
+		if (!peek) {
+		    ep->inbox.pop_front();
+		    delete c;
+		    ep->eof = 0;
+		}
+		release(s);
+		pthread_mutex_unlock(&mutex_);
+		if (error) {
+		    errno = error;
+		    return -1;
+		}
+		return 0;
+	    }
+
+	      // a datagram goes alone, and what does not fit is lost
+	    if (ep->datagram) {
+		size = (c->len < len) ? c->len : len;
+		memcpy(buf,c->data,size);
+		n = (flags & MSG_TRUNC) ? c->len : size;
+		if (!peek) {
+		    ep->inbox.pop_front();
+		    ep->held -= c->len;
+		    delete[] c->data;
+		    delete c;
+		}
+		release(s);
+		pthread_mutex_unlock(&mutex_);
+		return n;
+	    }
+
+	    size = c->len - c->off;
+	    if (size > len - total)
+		size = len - total;
+	    memcpy((char *) buf + total,c->data + c->off,size);
+	    total += size;
+	    if (peek) {
+		i++;
+		continue;
+	    }
+	    c->off += size;
+	    ep->held -= size;
+	    if (c->off == c->len) {
+		ep->inbox.pop_front();
+		delete[] c->data;
+		delete c;
+	    }
+	}
+	if (total > 0) {
+	    release(s);
+	    pthread_mutex_unlock(&mutex_);
+	    return total;
+	}
+
+	  // without a delay, receive directly unless data is still held
+	if (delay_ == 0 && jitter_ == 0 && ep->inbox.empty()) {
+	    release(s);
+	    pthread_mutex_unlock(&mutex_);
+	    return ::recv(s,buf,len,flags);
+	}
+
+	  // read ahead whatever has arrived and stamp it; each read
+	  // takes one datagram whole
+	reading = (!ep->eof && ep->held < maxhold_);
+	if (reading) {
+	    pthread_mutex_unlock(&mutex_);
+	    n = ::recv(s,data,sizeof(data),
+		       (flags & ~(MSG_WAITALL|MSG_PEEK|MSG_TRUNC)) |
+		       MSG_DONTWAIT);
+	    error = errno;
+	    pthread_mutex_lock(&mutex_);
+	    ep = &endpoints_[s];
+	    if (n < 0 && error == EINTR) {
+		release(s);
+		pthread_mutex_unlock(&mutex_);
+		errno = EINTR;
+		return -1;
+	    }
+	    if (n >= 0 || (error != EAGAIN && error != EWOULDBLOCK)) {
+		c = new chunk;
+		c->len = (n > 0) ? n : 0;
+		c->data = NULL;
+		if (n > 0) {
+		    c->data = new char[n];
+		    memcpy(c->data,data,n);
+		} else if (n < 0 || !ep->datagram) {
+		    ep->eof = 1;
+		}
+		c->off = 0;
+		c->fd = s;
+		c->flags = 0;
+		c->error = (n < 0) ? error : 0;
+		c->seq = seq_++;
+		stamp(ep,&c->due);
+		ep->inbox.push_back(c);
+		ep->held += c->len;
+		continue;
+	    }
+	}
+
+	  // nothing is due yet, so wait for more data or the next due
+	  // time, unless the caller must not block
+	if ((flags & MSG_DONTWAIT) || (fcntl(s,F_GETFL) & O_NONBLOCK)) {
+	    release(s);
+	    pthread_mutex_unlock(&mutex_);
+	    errno = EAGAIN;
+	    return -1;
+	}
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (ep->inbox.empty()) {
+	    pthread_mutex_unlock(&mutex_);
+	    ppoll(&pfd,reading,NULL,NULL);
+	} else {
+	    c = ep->inbox.front();
+	    wait.tv_sec = c->due.tv_sec - now.tv_sec;
+	    wait.tv_nsec = c->due.tv_nsec - now.tv_nsec;
+	    if (wait.tv_nsec < 0) {
+		wait.tv_sec -= 1;
+		wait.tv_nsec += 1000000000;
+	    }
+	    pthread_mutex_unlock(&mutex_);
+	    ppoll(&pfd,reading,&wait,NULL);
+	}
+	pthread_mutex_lock(&mutex_);
+    }
+}
+
+int
+DelayLine::close(int s)
+{
+    map<int,endpoint>::iterator i;
+
+    pthread_mutex_lock(&mutex_);
+    drop(s);
+    i = endpoints_.find(s);
+
+      // the sending thread closes the socket after its last chunk
+    if (i != endpoints_.end() && i->second.pending > 0) {
+	i->second.closing = 1;
+	pthread_mutex_unlock(&mutex_);
+	return 0;
+    }
+    if (i != endpoints_.end())
+	endpoints_.erase(i);
+    pthread_mutex_unlock(&mutex_);
+    return ::close(s);
+}
+
+void
+DelayLine::discard(int s)
+{
+    pthread_mutex_lock(&mutex_);
+    drop(s);
+    release(s);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void *
+DelayLine::run(void *arg)
+{
+    ((DelayLine *) arg)->sender();
+    return NULL;
+}
+
+void
+DelayLine::sender()
+{
+    map<int,endpoint>::iterator i;
+    struct timespec now, wait, *until;
+    vector<struct pollfd> pfds;
+    struct pollfd pfd;
+    uint64_t count;
+    chunk *c;
+    int s;
+
+    pthread_mutex_lock(&mutex_);
+    while (!stop_) {
+	  // chunks whose time has come join their socket's queue
+	clock_gettime(CLOCK_REALTIME,&now);
+	while (!outbox_.empty() &&
+	       !timespec_before(&now,&outbox_.top()->due)) {
+	    c = outbox_.top();
+	    outbox_.pop();
+	    endpoints_[c->fd].ready.push_back(c);
+	}
+
+	  // send what each socket has room for, and wait for room on
+	  // those that are full, or for a new chunk
+	pfds.clear();
+	pfd.fd = wake_;
+	pfd.events = POLLIN;
+	pfds.push_back(pfd);
+	for (i = endpoints_.begin(); i != endpoints_.end(); ) {
+	    s = (i++)->first;
+	    if (flush(s)) {
+		pfd.fd = s;
+		pfd.events = POLLOUT;
+		pfds.push_back(pfd);
+	    }
+	}
+
+	  // until the next chunk is due
+	until = NULL;
+	if (!outbox_.empty()) {
+	    c = outbox_.top();
+	    clock_gettime(CLOCK_REALTIME,&now);
+	    wait.tv_sec = 0;
+	    wait.tv_nsec = 0;
+	    if (timespec_before(&now,&c->due)) {
+		wait.tv_sec = c->due.tv_sec - now.tv_sec;
+		wait.tv_nsec = c->due.tv_nsec - now.tv_nsec;
+		if (wait.tv_nsec < 0) {
+		    wait.tv_sec -= 1;
+		    wait.tv_nsec += 1000000000;
+		}
+	    }
+	    until = &wait;
+	}
+	pthread_mutex_unlock(&mutex_);
+	ppoll(&pfds[0],pfds.size(),until,NULL);
+	if (pfds[0].revents & POLLIN)
+	    read(wake_,&count,sizeof(count));
+	pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+DelayLine::flush(int s)
+{
+    endpoint *ep;
+    ssize_t n;
+    chunk *c;
+
+      // the sends do not block, so the lock is held through them
+    ep = &endpoints_[s];
+    while (!ep->ready.empty()) {
+	c = ep->ready.front();
+	n = ::send(s,c->data + c->off,c->len - c->off,c->flags | MSG_DONTWAIT);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return 1;
+	if (n > 0) {
+	    c->off += n;
+	    if (c->off < c->len)
+		continue;
+	} else if (n < 0 && !ep->error) {
+	    ep->error = errno;
+	}
+
+	  // the chunk is sent, or failed
+	ep->ready.pop_front();
+	ep->pending--;
+	delete[] c->data;
+	delete c;
+    }
+
+    if (ep->pending == 0 && ep->closing) {
+	::close(s);
+	endpoints_.erase(s);
+    } else {
+	release(s);
+    }
+    return 0;
+}
+
+void
+DelayLine::stamp(endpoint *ep, struct timespec *due)
+{
+    clock_gettime(CLOCK_REALTIME,due);
+    timespec_add(due,sample());
+
+      // never due before the chunk ahead of it
+    if (timespec_before(due,&ep->last))
+	*due = ep->last;
+    ep->last = *due;
+}
+
+double
+DelayLine::sample()
+{
+    double u, v, d, shape;
+
+    d = delay_;
+    if (jitter_ > 0) {
+	u = erand48(seed_);
+	switch (dist_) {
+	case NORMAL:
+	      // Box-Muller transform
+	    v = erand48(seed_);
+	    d += jitter_ * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+	    break;
+	case PARETO:
+	      // scaled so that the mean extra delay is the jitter
+	    shape = 3;
+	    d += jitter_ * (shape - 1) / shape / pow(1 - u,1 / shape);
+	    break;
+	default:
+	    d += jitter_ * (2 * u - 1);
+	    break;
+	}
+    }
+    if (d < 0)
+	d = 0;
+    return d;
+}
+
+void
+DelayLine::drop(int s)
+{
+    map<int,endpoint>::iterator i;
+    endpoint *ep;
+
+    i = endpoints_.find(s);
+    if (i == endpoints_.end())
+	return;
+    ep = &i->second;
+    while (!ep->inbox.empty()) {
+	delete[] ep->inbox.front()->data;
+	delete ep->inbox.front();
+	ep->inbox.pop_front();
+    }
+    ep->held = 0;
+    ep->eof = 0;
+}
+
+int
+DelayLine::datagram(int s)
+{
+    socklen_t len;
+    int type;
+
+    len = sizeof(type);
+    return getsockopt(s,SOL_SOCKET,SO_TYPE,&type,&len) == 0 &&
+	type != SOCK_STREAM;
+}
+
+void
+DelayLine::release(int s)
+{
+    map<int,endpoint>::iterator i;
+
+      // forget sockets with nothing in flight
+    i = endpoints_.find(s);
+    if (i == endpoints_.end())
+	return;
+    if (i->second.pending == 0 && i->second.error == 0 &&
+	!i->second.closing && !i->second.eof && i->second.inbox.empty())
+	endpoints_.erase(i);
+}
@@ -0,0 +1,137 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef delay_line_h
+#define delay_line_h
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <deque>
+#include <map>
+#include <queue>
+#include <vector>
+
+// A DelayLine adds a one-way propagation delay, with optional jitter,
+// to the data sent or received on sockets.  This lets the rate
+// limiter emulate the latency of a link as well as its bandwidth.
+
+// Sent data is copied into a timestamped queue and the caller returns
+// at once.  A single thread, started on first use, sends each chunk
+// when its time comes, so in-flight data does not cost a sleeping
+// thread per chunk.  Chunks that are due wait in a queue of their
+// socket's own and are sent without blocking; a socket that is full
+// waits in poll() for room while the other sockets go on.  Errors from
+// a delayed send are reported by the next call on that socket, much
+// like a pending socket error.
+
+// Received data is read ahead from the socket as it arrives, stamped
+// with the time it is due, and handed to the next caller once that
+// time has passed.  At most maxhold bytes are read ahead per socket.
+// On a datagram socket each datagram is held whole and handed over
+// alone, truncated as recv() would if the caller's buffer is short.
+// MSG_PEEK leaves the data held for the next caller.
+
+// Jitter never reorders data on a socket, since that would corrupt a
+// byte stream; a chunk is never due before the chunk ahead of it.
+
+class DelayLine {
+ public:
+      // jitter distributions
+    enum { UNIFORM, NORMAL, PARETO };
+
+    DelayLine();
+    ~DelayLine();
+
+      // Set the delay and jitter in microseconds, and the distribution
+      // of the jitter.  Uniform jitter is spread evenly over +/- the
+      // jitter, normal jitter uses it as the standard deviation, and
+      // pareto jitter is a heavy-tailed extra delay with it as mean.
+    void set_delay(int,int,int);
+
+      // Set the maximum bytes read ahead per socket when receiving.
+    inline void set_maxhold(size_t m) { maxhold_ = m; }
+
+      // Queue data to be sent once its delay has passed.  Returns the
+      // number of characters queued on success, otherwise -1 and errno
+      // is set to indicate the error of an earlier delayed send.
+      // Without a delay, and with nothing queued, this is one send().
+    ssize_t send(int,const void*,size_t,int);
+
+      // Receive data once its delay has passed.  Returns the number of
+      // characters received, 0 at the end of the stream, otherwise -1
+      // and errno is set to indicate the exact error.
+    ssize_t recv(int,void*,size_t,int);
+
+      // Close a socket.  Data still queued for sending is sent first,
+      // and data held for receiving is discarded.
+    int close(int);
+
+      // Discard data held for receiving on a socket without closing it.
+    void discard(int);
+
+ private:
+    struct chunk {
+	struct timespec due;
+	unsigned long seq;
+	int fd;
+	int flags;
+	int error;
+	size_t len;
+	size_t off;
+	char *data;
+    };
+    struct later {
+	bool operator()(const chunk *a, const chunk *b) const {
+	    if (a->due.tv_sec != b->due.tv_sec)
+		return a->due.tv_sec > b->due.tv_sec;
+	    if (a->due.tv_nsec != b->due.tv_nsec)
+		return a->due.tv_nsec > b->due.tv_nsec;
+	    return a->seq > b->seq;
+	}
+    };
+    struct endpoint {
+	endpoint() : pending(0), error(0), closing(0), eof(0),
+		     datagram(-1), held(0) {
+	    last.tv_sec = 0;
+	    last.tv_nsec = 0;
+	}
+	struct timespec last;
+	int pending;
+	int error;
+	int closing;
+	int eof;
+	int datagram;
+	size_t held;
+	std::deque<chunk*> inbox;
+	std::deque<chunk*> ready;
+    };
+
+    static void *run(void*);
+    void sender();
+    int flush(int);
+    void stamp(endpoint*,struct timespec*);
+    double sample();
+    void drop(int);
+    void release(int);
+    static int datagram(int);
+
+    pthread_mutex_t mutex_;
+    pthread_t thread_;
+    int wake_;
+    int started_;
+    int stop_;
+
+    double delay_;
+    double jitter_;
+    int dist_;
+    unsigned short seed_[3];
+    size_t maxhold_;
+
+    unsigned long seq_;
+    std::priority_queue<chunk*,std::vector<chunk*>,later> outbox_;
+    std::map<int,endpoint> endpoints_;
+};
+
+#endif /*delay_line_h*/
@@ -0,0 +1,128 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include "fairqueue.h"
+#include "timespec.h"
+
+using namespace std;
+
+FairQueue::FairQueue()
+{
+    vtime_ = 0;
+    seq_ = 0;
+}
+
+void
+FairQueue::set_weight(int fd, int weight)
+{
+    flow &f = flows_[fd];
+
+    f.weight = (weight > 1) ? weight : 1;
+}
+
+void
+FairQueue::forget(int fd)
+{
+    flows_.erase(fd);
+}
+
+int
+FairQueue::wait(pthread_mutex_t *mutex, int fd, size_t size,
+		struct timespec *free)
+{
+    struct timespec now;
+    request req;
+    flow *f;
+
+      // stamp the chunk with its finish tag
+    f = &flows_[fd];
+    if (f->weight < 1)
+	f->weight = 1;
+    req.tag = (f->finish > vtime_ ? f->finish : vtime_) +
+	(double) size / f->weight;
+    req.seq = seq_++;
+    req.fd = fd;
+    req.cancelled = 0;
+    f->finish = req.tag;
+    pthread_cond_init(&req.wake,NULL);
+    waiting_.push(&req);
+
+      // wait until I am first in line and the link is free; only the
+      // first in line needs to watch the clock
+    while (1) {
+	if (req.cancelled) {
+	    pthread_cond_destroy(&req.wake);
+	    return -1;
+	}
+	clock_gettime(CLOCK_REALTIME,&now);
+	if (waiting_.top() != &req)
+	    pthread_cond_wait(&req.wake,mutex);
+	else if (timespec_before(&now,free))
+	    pthread_cond_timedwait(&req.wake,mutex,free);
+	else
+	    break;
+    }
+
+      // take the link and hand the head of the line to the next chunk
+    waiting_.pop();
+    vtime_ = req.tag;
+    flows_[fd].bytes += size;
+    if (!waiting_.empty())
+	pthread_cond_signal(&waiting_.top()->wake);
+    pthread_cond_destroy(&req.wake);
+    return 0;
+}
+
+void
+FairQueue::cancel(int fd)
+{
+    vector<request*> keep;
+    request *head, *r;
+    size_t i;
+
+    if (waiting_.empty())
+	return;
+
+      // take every chunk out of line, and put back the ones that stay
+    head = waiting_.top();
+    while (!waiting_.empty()) {
+	r = waiting_.top();
+	waiting_.pop();
+	if (fd < 0 || r->fd == fd) {
+	    r->cancelled = 1;
+	    pthread_cond_signal(&r->wake);
+	} else {
+	    keep.push_back(r);
+	}
+    }
+    for (i = 0; i < keep.size(); i++)
+	waiting_.push(keep[i]);
+
+      // a new head of the line must start watching the clock
+    if (!waiting_.empty() && waiting_.top() != head)
+	pthread_cond_signal(&waiting_.top()->wake);
+}
+
+double
+FairQueue::fairness()
+{
+    map<int,flow>::iterator i;
+    double x, sum, squares;
+    int n;
+
+    sum = 0;
+    squares = 0;
+    n = 0;
+    for (i = flows_.begin(); i != flows_.end(); i++) {
+	if (i->second.bytes == 0)
+	    continue;
+	x = i->second.bytes / i->second.weight;
+	sum += x;
+	squares += x * x;
+	n++;
+	i->second.bytes = 0;
+    }
+    if (n == 0)
+	return 1;
+    return sum * sum / (n * squares);
+}
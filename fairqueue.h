@@ -0,0 +1,88 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef fair_queue_h
+#define fair_queue_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <map>
+#include <queue>
+#include <vector>
+
+// A FairQueue decides which flow sends next when several flows share
+// the rate limiter, instead of leaving it to whichever thread wins the
+// lock.  Each socket is a flow with a weight, 1 by default.
+
+// It uses self-clocked fair queueing, a form of weighted fair queueing.
+// Each chunk gets a finish tag: the later of the virtual time and its
+// flow's previous tag, plus its size divided by the flow's weight.  The
+// virtual time is the tag of the chunk last given the link.  Whenever
+// the link comes free, the waiting chunk with the smallest tag goes
+// next, so only one chunk is ever scheduled ahead.  Chunks of one
+// flow never tie, and ties between flows go to the chunk that arrived
+// last.  That gives a flow with a single thread, which can only ask
+// again after its chunk has gone, its turn ahead of flows that always
+// have a chunk waiting.  A flow's lag behind
+// its weighted share is then bounded by about one chunk from every
+// other flow.
+
+// A FairQueue is not thread safe on its own; the rate limiter calls it
+// while holding its lock, which wait() releases while sleeping.
+
+class FairQueue {
+ public:
+    FairQueue();
+
+      // Set the weight of a flow.  A weight below 1 counts as 1.
+    void set_weight(int,int);
+
+      // Forget a flow, when its socket is closed.
+    void forget(int);
+
+      // Wait until a chunk of a flow is next in line and the link is
+      // free at the time it is given, which others may move while we
+      // wait.  The mutex must be held, and is held again on return.
+      // Returns 0, or -1 if the chunk was cancelled while it waited.
+    int wait(pthread_mutex_t*,int,size_t,struct timespec*);
+
+      // Cancel the chunks of a flow that are waiting, or of every flow
+      // if the socket is -1.  The mutex must be held.
+    void cancel(int);
+
+      // Get Jain's fairness index of the bytes each flow has sent,
+      // divided by its weight, since the last call.  It is 1 when
+      // every flow got exactly its share, and 1/n when one of n flows
+      // got everything.  Returns 1 if no flow sent anything.
+    double fairness();
+
+ private:
+    struct flow {
+	int weight;
+	double finish;
+	double bytes;
+    };
+    struct request {
+	double tag;
+	unsigned long seq;
+	int fd;
+	int cancelled;
+	pthread_cond_t wake;
+    };
+    struct later {
+	bool operator()(const request *a, const request *b) const {
+	    if (a->tag != b->tag)
+		return a->tag > b->tag;
+	    return a->seq < b->seq;
+	}
+    };
+
+    double vtime_;
+    unsigned long seq_;
+    std::map<int,flow> flows_;
+    std::priority_queue<request*,std::vector<request*>,later> waiting_;
+};
+
+#endif /*fair_queue_h*/
@@ -0,0 +1,232 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gcra.h"
+
+  // how far to probe for a flow's slot before giving up
+static const int max_probe = 32;
+
+struct GcraTable::entry {
+    uint64_t key;
+    int64_t tat;
+};
+
+  // Charge a TAT for a cost, unless there is a limit and the wait would
+  // be longer.  Returns how long to wait.
+static int64_t
+charge(int64_t *tat, int64_t cost, int64_t tolerance, int64_t now,
+       int64_t limit)
+{
+    int64_t old, next, wait;
+
+    old = __atomic_load_n(tat,__ATOMIC_RELAXED);
+    do {
+	next = (old > now ? old : now) + cost;
+	wait = next - tolerance - now;
+	if (wait < 0)
+	    wait = 0;
+	if (limit >= 0 && wait > limit)
+	    return wait;
+    } while (!__atomic_compare_exchange_n(tat,&old,next,1,__ATOMIC_RELAXED,
+					  __ATOMIC_RELAXED));
+    return wait;
+}
+
+GcraEngine::GcraEngine(int rate, size_t burst)
+{
+    tat_ = 0;
+    set_rate(rate,burst);
+}
+
+void
+GcraEngine::set_rate(int rate, size_t burst)
+{
+    int64_t step, tolerance;
+
+      // the time per byte is kept in picoseconds
+    step = 0;
+    tolerance = 0;
+    if (rate > 0) {
+	step = (int64_t) (8e12 / rate);
+	tolerance = (int64_t) (burst * step / 1000);
+    }
+    __atomic_store_n(&step_,step,__ATOMIC_RELAXED);
+    __atomic_store_n(&tolerance_,tolerance,__ATOMIC_RELAXED);
+}
+
+int64_t
+GcraEngine::cost(size_t size)
+{
+    return (int64_t) size * __atomic_load_n(&step_,__ATOMIC_RELAXED) / 1000;
+}
+
+int
+GcraEngine::admit(size_t size, int64_t now, int64_t *wait)
+{
+    *wait = charge(&tat_,cost(size),
+		   __atomic_load_n(&tolerance_,__ATOMIC_RELAXED),now,0);
+    return *wait ? -1 : 0;
+}
+
+int64_t
+GcraEngine::reserve(size_t size, int64_t now)
+{
+    return charge(&tat_,cost(size),
+		  __atomic_load_n(&tolerance_,__ATOMIC_RELAXED),now,-1);
+}
+
+int
+GcraEngine::reserve(size_t size, int64_t now, int64_t max, int64_t *wait)
+{
+    *wait = charge(&tat_,cost(size),
+		   __atomic_load_n(&tolerance_,__ATOMIC_RELAXED),now,max);
+    return (max >= 0 && *wait > max) ? -1 : 0;
+}
+
+void
+GcraEngine::give(size_t size)
+{
+    __atomic_fetch_sub(&tat_,cost(size),__ATOMIC_RELAXED);
+}
+
+int64_t
+GcraEngine::delay(int64_t now)
+{
+    int64_t wait;
+
+    wait = __atomic_load_n(&tat_,__ATOMIC_RELAXED) -
+	__atomic_load_n(&tolerance_,__ATOMIC_RELAXED) - now;
+    return wait > 0 ? wait : 0;
+}
+
+int64_t
+GcraEngine::now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME,&t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+GcraTable::GcraTable(size_t flows, int rate, size_t burst)
+    : rate_(rate,burst)
+{
+    size_t size;
+
+      // keep the table at most half full, plus the overflow slot
+    size = 2;
+    while (size < flows * 2)
+	size <<= 1;
+    mask_ = size - 1;
+    table_ = (entry *) calloc(size + 1,sizeof(entry));
+    if (!table_)
+	abort();
+}
+
+GcraTable::~GcraTable()
+{
+    free(table_);
+}
+
+void
+GcraTable::set_rate(int rate, size_t burst)
+{
+    rate_.set_rate(rate,burst);
+}
+
+  // Get the key a flow's slot is marked with.
+static uint64_t
+mark(uint64_t key)
+{
+      // key 0 marks an empty slot
+    key++;
+    return key ? key : 1;
+}
+
+GcraTable::entry *
+GcraTable::find(uint64_t k, int64_t now)
+{
+    uint64_t hash, old;
+    int64_t tolerance;
+    entry *e, *idle;
+    int i;
+
+    hash = k * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+    tolerance = __atomic_load_n(&rate_.tolerance_,__ATOMIC_RELAXED);
+
+    idle = NULL;
+    for (i = 0; i < max_probe; i++) {
+	e = &table_[(hash + i) & mask_];
+	old = __atomic_load_n(&e->key,__ATOMIC_ACQUIRE);
+	if (old == k)
+	    return e;
+	if (old == 0) {
+	    if (__atomic_compare_exchange_n(&e->key,&old,k,0,
+					    __ATOMIC_ACQ_REL,
+					    __ATOMIC_ACQUIRE) || old == k)
+		return e;
+	    continue;
+	}
+	if (!idle &&
+	    __atomic_load_n(&e->tat,__ATOMIC_RELAXED) + tolerance <= now)
+	    idle = e;
+    }
+
+      // take over the slot of a flow that has gone idle
+    if (idle) {
+	old = __atomic_load_n(&idle->key,__ATOMIC_ACQUIRE);
+	if (old != k &&
+	    __atomic_compare_exchange_n(&idle->key,&old,k,0,__ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+	    return idle;
+	if (old == k)
+	    return idle;
+    }
+    return &table_[mask_ + 1];
+}
+
+int64_t
+GcraTable::spend(uint64_t key, size_t size, int64_t now, int64_t limit)
+{
+    uint64_t k;
+    int64_t cost, wait;
+    entry *e;
+    int i;
+
+    k = mark(key);
+    cost = rate_.cost(size);
+    for (i = 0; ; i++) {
+	e = i < max_probe ? find(k,now) : &table_[mask_ + 1];
+	wait = charge(&e->tat,cost,
+		      __atomic_load_n(&rate_.tolerance_,__ATOMIC_RELAXED),
+		      now,limit);
+	if (limit >= 0 && wait > limit)
+	    return wait;
+	  // An idle slot may have been taken over by another flow between
+	  // finding it and charging it.  The charge then belongs to the
+	  // new owner, so take it back and find the flow's slot again.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (e == &table_[mask_ + 1] ||
+	    __atomic_load_n(&e->key,__ATOMIC_ACQUIRE) == k)
+	    return wait;
+	__atomic_fetch_sub(&e->tat,cost,__ATOMIC_RELAXED);
+    }
+}
+
+int
+GcraTable::admit(uint64_t key, size_t size, int64_t now, int64_t *wait)
+{
+    *wait = spend(key,size,now,0);
+    return *wait ? -1 : 0;
+}
+
+int64_t
+GcraTable::reserve(uint64_t key, size_t size, int64_t now)
+{
+    return spend(key,size,now,-1);
+}
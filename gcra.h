@@ -0,0 +1,108 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef gcra_h
+#define gcra_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The generic cell rate algorithm admits data against a single
+// timestamp, the theoretical arrival time (TAT): the time at which the
+// flow would have been sent if it had always been paced at the rate.
+// Data may go as long as the TAT, after charging for it, is less than
+// one burst's worth of time ahead of now.
+
+// Since the whole state is one 64-bit word, it is updated with a
+// compare-and-swap and needs no lock, and a table of flows costs 16
+// bytes per flow.  Times are in nanoseconds on the realtime clock.
+
+class GcraEngine {
+ public:
+      // Create an engine with a rate in bps and a burst in bytes.
+    GcraEngine(int,size_t);
+
+      // Set the rate in bps and the burst in bytes.
+    void set_rate(int,size_t);
+
+      // Admit a number of bytes now or not at all.  Returns 0 if they
+      // were admitted.  Otherwise returns -1, charges nothing, and sets
+      // how long to wait before they would be admitted.
+    int admit(size_t,int64_t,int64_t*);
+
+      // Charge a number of bytes and return how long to wait before
+      // sending them.
+    int64_t reserve(size_t,int64_t);
+
+      // Charge a number of bytes and set how long to wait, unless the
+      // wait would be longer than the given bound, in which case
+      // nothing is charged and -1 is returned.
+    int reserve(size_t,int64_t,int64_t,int64_t*);
+
+      // Give back the charge for bytes that were not sent.
+    void give(size_t);
+
+      // Get how long from now before any data would be admitted.
+    int64_t delay(int64_t);
+
+      // Get or set the theoretical arrival time, to carry the engine's
+      // state over to another one.
+    inline int64_t get_tat() {
+	return __atomic_load_n(&tat_,__ATOMIC_RELAXED);
+    }
+    inline void set_tat(int64_t t) {
+	__atomic_store_n(&tat_,t,__ATOMIC_RELAXED);
+    }
+
+      // Get the current time.
+    static int64_t now();
+
+ private:
+    friend class GcraTable;
+
+    int64_t cost(size_t);
+
+    int64_t tat_;
+    int64_t step_;
+    int64_t tolerance_;
+};
+
+// A GcraTable keeps a TAT for each of many flows, named by a 64-bit
+// key, in an open-addressed table of fixed size with no lock.  All
+// flows share one rate and burst.  A flow that has been idle for a
+// full burst is back where a new flow starts, so its slot may be
+// taken by another flow.  A charge that lands on a slot just as it
+// changes hands is taken back and made again on the flow's own slot.
+// If no slot can be found, flows share an overflow slot, which errs
+// on the side of sending less.
+
+// The limiter itself keeps one engine for everything it paces, so a
+// table is not reachable through RateLimiter.  It is meant for servers
+// that admit each client or key on their own before sending, and it
+// takes times from GcraEngine::now().
+
+class GcraTable {
+ public:
+      // Create a table for a number of flows, with a rate in bps and a
+      // burst in bytes.
+    GcraTable(size_t,int,size_t);
+    ~GcraTable();
+
+    void set_rate(int,size_t);
+
+      // As for GcraEngine, for the given flow.
+    int admit(uint64_t,size_t,int64_t,int64_t*);
+    int64_t reserve(uint64_t,size_t,int64_t);
+
+ private:
+    struct entry;
+
+    entry *find(uint64_t,int64_t);
+    int64_t spend(uint64_t,size_t,int64_t,int64_t);
+
+    struct entry *table_;
+    size_t mask_;
+    GcraEngine rate_;
+};
+
+#endif /*gcra_h*/
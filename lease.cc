@@ -0,0 +1,425 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lease.h"
+#include "timespec.h"
+
+static const uint32_t lease_magic = 0x524c4c31;
+
+  // how long to wait before asking an unreachable coordinator again,
+  // or a coordinator that had nothing to give
+static const double retry_unreachable = 0.1;
+static const double retry_empty = 0.005;
+
+struct request {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t want;
+};
+
+struct reply {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t granted;
+    uint32_t ttl;
+    uint32_t pad;
+};
+
+Coordinator::Coordinator(int kbps, size_t burst, int ttl)
+{
+    pthread_mutex_init(&mutex_,NULL);
+    rate_ = kbps*1000;
+    burst_ = burst;
+    ttl_ = (double) ttl / 1000;
+    tokens_ = burst;
+    clock_gettime(CLOCK_REALTIME,&last_);
+    sock_ = -1;
+    stop_ = 0;
+}
+
+Coordinator::~Coordinator()
+{
+    if (sock_ >= 0) {
+	__atomic_store_n(&stop_,1,__ATOMIC_RELEASE);
+	pthread_join(thread_,NULL);
+	close(sock_);
+    }
+    pthread_mutex_destroy(&mutex_);
+}
+
+int
+Coordinator::acquire(size_t want, size_t *granted, double *ttl)
+{
+    struct timespec now;
+
+    pthread_mutex_lock(&mutex_);
+
+      // refill the bucket at the fleet-wide rate
+    clock_gettime(CLOCK_REALTIME,&now);
+    tokens_ += timespec_elapsed(&now,&last_) * rate_ / 8;
+    if (tokens_ > burst_)
+	tokens_ = burst_;
+    last_ = now;
+
+    *granted = want;
+    if (*granted > tokens_)
+	*granted = (size_t) tokens_;
+    tokens_ -= *granted;
+    *ttl = ttl_;
+
+    pthread_mutex_unlock(&mutex_);
+    return 0;
+}
+
+int
+Coordinator::serve(int port)
+{
+    struct sockaddr_in addr;
+    struct timeval tv;
+    socklen_t len;
+
+    sock_ = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_ < 0)
+	return -1;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr);
+    if (bind(sock_,(struct sockaddr *) &addr,sizeof(addr)) < 0 ||
+	getsockname(sock_,(struct sockaddr *) &addr,&len) < 0)
+	goto error;
+
+      // wake up now and then to see if we should stop
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(sock_,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    if (pthread_create(&thread_,NULL,run,this) != 0)
+	goto error;
+    return ntohs(addr.sin_port);
+
+ error:
+    close(sock_);
+    sock_ = -1;
+    return -1;
+}
+
+void *
+Coordinator::run(void *arg)
+{
+    ((Coordinator *) arg)->server();
+    return NULL;
+}
+
+void
+Coordinator::server()
+{
+    struct sockaddr_in from;
+    struct request req;
+    struct reply rep;
+    socklen_t len;
+    size_t granted;
+    double ttl;
+
+    while (!__atomic_load_n(&stop_,__ATOMIC_ACQUIRE)) {
+	len = sizeof(from);
+	if (recvfrom(sock_,&req,sizeof(req),0,(struct sockaddr *) &from,
+		     &len) != sizeof(req))
+	    continue;
+	if (ntohl(req.magic) != lease_magic)
+	    continue;
+	acquire(be64toh(req.want),&granted,&ttl);
+	rep.magic = htonl(lease_magic);
+	rep.seq = req.seq;
+	rep.granted = htobe64(granted);
+	rep.ttl = htonl((uint32_t) (ttl * 1000));
+	rep.pad = 0;
+	sendto(sock_,&rep,sizeof(rep),0,(struct sockaddr *) &from,len);
+    }
+}
+
+LeaseClient::LeaseClient(const char *host, int port, int timeout)
+{
+    struct sockaddr_in addr;
+
+    timeout_ = timeout;
+    seq_ = 0;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET,host,&addr.sin_addr);
+    sock_ = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_ >= 0)
+	connect(sock_,(struct sockaddr *) &addr,sizeof(addr));
+}
+
+LeaseClient::~LeaseClient()
+{
+    if (sock_ >= 0)
+	close(sock_);
+}
+
+int
+LeaseClient::acquire(size_t want, size_t *granted, double *ttl)
+{
+    struct timespec start, now;
+    struct pollfd pfd;
+    struct request req;
+    struct reply rep;
+    int left;
+
+    if (sock_ < 0) {
+	errno = EBADF;
+	return -1;
+    }
+    req.magic = htonl(lease_magic);
+    req.seq = htonl(++seq_);
+    req.want = htobe64(want);
+    if (send(sock_,&req,sizeof(req),0) < 0)
+	return -1;
+
+      // wait for the reply to this request, ignoring late replies to
+      // earlier ones
+    clock_gettime(CLOCK_REALTIME,&start);
+    pfd.fd = sock_;
+    pfd.events = POLLIN;
+    while (1) {
+	clock_gettime(CLOCK_REALTIME,&now);
+	left = timeout_ - (int) (timespec_elapsed(&now,&start) * 1000);
+	if (left <= 0 || poll(&pfd,1,left) == 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	if (recv(sock_,&rep,sizeof(rep),0) != sizeof(rep)) {
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return -1;
+	}
+	if (ntohl(rep.magic) == lease_magic && ntohl(rep.seq) == seq_)
+	    break;
+    }
+    *granted = be64toh(rep.granted);
+    *ttl = (double) ntohl(rep.ttl) / 1000;
+    return 0;
+}
+
+LeaseBudget::LeaseBudget(LeaseSource *source, size_t size, int fallback)
+{
+    source_ = source;
+    size_ = size;
+    fallback_ = fallback*1000;
+    pthread_mutex_init(&mutex_,NULL);
+    pthread_cond_init(&renew_,NULL);
+    pthread_cond_init(&ready_,NULL);
+    stop_ = 0;
+    stopped_ = 0;
+    tokens_ = 0;
+    ttl_ = 0;
+    reachable_ = 1;
+    used_ = 0;
+    waiters_ = 0;
+    clock_gettime(CLOCK_REALTIME,&expiry_);
+    retry_ = expiry_;
+    next_ = expiry_;
+    pthread_create(&thread_,NULL,run,this);
+}
+
+LeaseBudget::~LeaseBudget()
+{
+    pthread_mutex_lock(&mutex_);
+    stop_ = 1;
+    pthread_cond_signal(&renew_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_,NULL);
+    pthread_cond_destroy(&ready_);
+    pthread_cond_destroy(&renew_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+int64_t
+LeaseBudget::take(size_t size, int64_t bound)
+{
+    struct timespec now, deadline, end;
+    double duration;
+    int64_t wait;
+
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    timespec_add(&deadline,(double) bound / 1000000000);
+
+    pthread_mutex_lock(&mutex_);
+    while (1) {
+	if (stopped_) {
+	    pthread_mutex_unlock(&mutex_);
+	    errno = ECANCELED;
+	    return -1;
+	}
+	clock_gettime(CLOCK_REALTIME,&now);
+	if (!timespec_before(&now,&expiry_))
+	    tokens_ = 0;
+
+	  // spend the lease locally
+	if (tokens_ >= size) {
+	    tokens_ -= size;
+	    used_ = 1;
+	    if (tokens_ < size_ / 2)
+		pthread_cond_signal(&renew_);
+	    pthread_mutex_unlock(&mutex_);
+	    return 0;
+	}
+
+	  // pace at the fallback rate until the coordinator is back,
+	  // unless the bytes would come too late
+	if (!reachable_ && fallback_ > 0) {
+	    duration = (double) (size * 8) / fallback_;
+	    end = timespec_before(&next_,&now) ? now : next_;
+	    timespec_add(&end,duration);
+	    wait = (int64_t) (timespec_elapsed(&end,&now) * 1000000000);
+	    if (bound >= 0 && wait > bound)
+		break;
+	    next_ = end;
+	    pthread_mutex_unlock(&mutex_);
+	    return wait;
+	}
+
+	  // wait for a renewal, for as long as the caller allows; a
+	  // caller turned away still wants one
+	used_ = 1;
+	pthread_cond_signal(&renew_);
+	if (bound >= 0 && !timespec_before(&now,&deadline))
+	    break;
+	waiters_++;
+	if (bound >= 0)
+	    pthread_cond_timedwait(&ready_,&mutex_,&deadline);
+	else
+	    pthread_cond_wait(&ready_,&mutex_);
+	waiters_--;
+    }
+    pthread_mutex_unlock(&mutex_);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+int64_t
+LeaseBudget::delay(size_t size)
+{
+    struct timespec now;
+    int64_t wait;
+
+      // no lease holds more than one grant
+    if (size > size_)
+	size = size_;
+    pthread_mutex_lock(&mutex_);
+    clock_gettime(CLOCK_REALTIME,&now);
+    wait = 0;
+    if (!reachable_ && fallback_ > 0) {
+	if (timespec_before(&now,&next_))
+	    wait = (int64_t) (timespec_elapsed(&next_,&now) * 1000000000);
+    } else if (tokens_ < size || !timespec_before(&now,&expiry_)) {
+	  // a renewal is due; look again no sooner than the renewer
+	  // would ask for it
+	wait = (int64_t) (retry_empty * 1000000000);
+	if (timespec_before(&now,&retry_))
+	    wait = (int64_t) (timespec_elapsed(&retry_,&now) * 1000000000);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return wait;
+}
+
+void
+LeaseBudget::stop()
+{
+    pthread_mutex_lock(&mutex_);
+    stopped_ = 1;
+    pthread_cond_broadcast(&ready_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+LeaseBudget::give(size_t size)
+{
+    struct timespec now;
+
+    pthread_mutex_lock(&mutex_);
+    clock_gettime(CLOCK_REALTIME,&now);
+    if (timespec_before(&now,&expiry_))
+	tokens_ += size;
+    pthread_mutex_unlock(&mutex_);
+}
+
+void *
+LeaseBudget::run(void *arg)
+{
+    ((LeaseBudget *) arg)->renewer();
+    return NULL;
+}
+
+void
+LeaseBudget::renewer()
+{
+    struct timespec now, when;
+    size_t granted;
+    double ttl;
+    int result;
+
+    pthread_mutex_lock(&mutex_);
+    while (!stop_) {
+	clock_gettime(CLOCK_REALTIME,&now);
+
+	  // hold off after a failure or an empty grant
+	if (timespec_before(&now,&retry_)) {
+	    pthread_cond_timedwait(&renew_,&mutex_,&retry_);
+	    continue;
+	}
+
+	  // renew when someone is waiting, or when a lease in use runs
+	  // low or is about to expire; an idle node lets its lease lapse
+	when = expiry_;
+	timespec_add(&when,-ttl_ / 4);
+	if (!waiters_ && (!used_ || (tokens_ >= size_ / 2 &&
+				     timespec_before(&now,&when)))) {
+	    if (used_)
+		pthread_cond_timedwait(&renew_,&mutex_,&when);
+	    else
+		pthread_cond_wait(&renew_,&mutex_);
+	    continue;
+	}
+
+	pthread_mutex_unlock(&mutex_);
+	result = source_->acquire(size_,&granted,&ttl);
+	pthread_mutex_lock(&mutex_);
+	clock_gettime(CLOCK_REALTIME,&now);
+
+	if (result < 0) {
+	    reachable_ = 0;
+	    retry_ = now;
+	    timespec_add(&retry_,retry_unreachable);
+	    pthread_cond_broadcast(&ready_);
+	    continue;
+	}
+	reachable_ = 1;
+	used_ = 0;
+	if (!timespec_before(&now,&expiry_))
+	    tokens_ = 0;
+	tokens_ += granted;
+	ttl_ = ttl;
+	expiry_ = now;
+	timespec_add(&expiry_,ttl);
+	if (granted == 0) {
+	    retry_ = now;
+	    timespec_add(&retry_,retry_empty);
+	}
+	pthread_cond_broadcast(&ready_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
@@ -0,0 +1,138 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef lease_h
+#define lease_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Leases let the rate limiters on many nodes share one fleet-wide
+// budget.  A coordinator hands out time-limited leases of bytes, and
+// each node admits data against its current lease without contacting
+// the coordinator.  A background thread renews the lease before it
+// runs out, so the coordinator is never on the path of a send.
+
+// A LeaseSource is anything that grants leases.
+class LeaseSource {
+ public:
+    virtual ~LeaseSource() {}
+
+      // Ask for a lease of up to the given number of bytes.  Returns
+      // 0 and sets the bytes granted, which may be 0, and the lifetime
+      // of the lease in seconds.  Otherwise returns -1 and errno is
+      // set to indicate the exact error.
+    virtual int acquire(size_t,size_t*,double*) = 0;
+};
+
+// A Coordinator grants leases from a token bucket filled at the
+// fleet-wide rate.  It can be used directly in the same process, or
+// serve other nodes over UDP, which makes it a stand-in for a real
+// coordination service when testing.
+class Coordinator : public LeaseSource {
+ public:
+      // Create a coordinator with a rate in kbps, a bucket size in
+      // bytes, and a lease lifetime in milliseconds.
+    Coordinator(int,size_t,int);
+    ~Coordinator();
+
+    int acquire(size_t,size_t*,double*);
+
+      // Serve leases over UDP on a port of the loopback address.  A
+      // port of 0 picks a free one.  Returns the port on success,
+      // otherwise -1 and errno is set to indicate the exact error.
+    int serve(int);
+
+ private:
+    static void *run(void*);
+    void server();
+
+    pthread_mutex_t mutex_;
+    int rate_;
+    size_t burst_;
+    double ttl_;
+    double tokens_;
+    struct timespec last_;
+
+    int sock_;
+    int stop_;
+    pthread_t thread_;
+};
+
+// A LeaseClient asks a Coordinator for leases over UDP.
+class LeaseClient : public LeaseSource {
+ public:
+      // Create a client for a coordinator at an IPv4 address and
+      // port, waiting at most the given milliseconds for each reply.
+    LeaseClient(const char*,int,int);
+    ~LeaseClient();
+
+    int acquire(size_t,size_t*,double*);
+
+ private:
+    int sock_;
+    int timeout_;
+    unsigned int seq_;
+};
+
+// A LeaseBudget holds a node's current lease and renews it in the
+// background whenever it runs low or is about to expire.  If the
+// coordinator cannot be reached, the node falls back to pacing at a
+// safe local rate until it can be reached again.
+class LeaseBudget {
+ public:
+      // Create a budget that asks a source for leases of the given
+      // size in bytes, with a fallback rate in kbps.
+    LeaseBudget(LeaseSource*,size_t,int);
+    ~LeaseBudget();
+
+      // Take bytes from the lease, waiting for a renewal if the lease
+      // has run out, but no longer than the given nanoseconds; a bound
+      // of -1 waits as long as it takes.  If the coordinator cannot be
+      // reached, the bytes are paced at the fallback rate instead, and
+      // the caller is left to wait for them.  Returns the nanoseconds
+      // to wait before sending on success, otherwise -1 and errno is
+      // set to ETIMEDOUT if the bytes cannot be had within the bound,
+      // or to ECANCELED once the budget is stopped.
+    int64_t take(size_t,int64_t);
+
+      // Get the nanoseconds until the given number of bytes can be
+      // taken without waiting for a renewal, as best it can be told.
+    int64_t delay(size_t);
+
+      // Wake every call waiting for a renewal and turn away any that
+      // would wait from now on.
+    void stop();
+
+      // Give back bytes taken but not sent, if the lease they came
+      // from has not expired.
+    void give(size_t);
+
+ private:
+    static void *run(void*);
+    void renewer();
+
+    LeaseSource *source_;
+    size_t size_;
+    int fallback_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t renew_;
+    pthread_cond_t ready_;
+    pthread_t thread_;
+    int stop_;
+    int stopped_;
+
+    double tokens_;
+    struct timespec expiry_;
+    double ttl_;
+    int reachable_;
+    int used_;
+    int waiters_;
+    struct timespec retry_;
+    struct timespec next_;
+};
+
+#endif /*lease_h*/
@@ -0,0 +1,511 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+// This shim lets unmodified programs run through a rate limiter.  It
+// is built as a shared library and loaded with LD_PRELOAD, and it
+// interposes send(), recv(), write(), read(), sendfile(), sendmsg(),
+// recvmsg(), sendmmsg(), recvmmsg() and splice() on sockets, routing
+// them through a single process-wide limiter.  It can also route
+// write(), read(), pwrite() and pread() on regular files and block
+// devices through the limiter, to throttle a background job's disk
+// I/O.  I/O on anything else goes straight to the real call.  It
+// watches close(), close_range(), closefrom(), dup() and fcntl() too,
+// so a descriptor number reused for something else is not mistaken
+// for what it was before.
+
+// The limiter is configured from the environment:
+
+// RATELIMIT_KBPS        rate in kilobits per second
+// RATELIMIT_BURST       maximum burst size in bytes
+// RATELIMIT_SEND_TRACE  bandwidth trace to replay when sending
+// RATELIMIT_RECV_TRACE  bandwidth trace to replay when receiving
+// RATELIMIT_QUEUE       bottleneck queue, as droptail|red|codel:bytes
+// RATELIMIT_OPS         operations per second in each direction
+// RATELIMIT_FILES       1 to pace files and block devices as well
+
+// Without any of these, every call goes straight to the real call.
+// Delay lines are not available here, since their sending thread
+// would itself be interposed.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ratelimiter.h"
+
+  // the real calls
+static ssize_t (*real_send)(int,const void*,size_t,int);
+static ssize_t (*real_recv)(int,void*,size_t,int);
+static ssize_t (*real_write)(int,const void*,size_t);
+static ssize_t (*real_read)(int,void*,size_t);
+static ssize_t (*real_pwrite)(int,const void*,size_t,off_t);
+static ssize_t (*real_pread)(int,void*,size_t,off_t);
+static ssize_t (*real_sendfile)(int,int,off_t*,size_t);
+static ssize_t (*real_sendmsg)(int,const struct msghdr*,int);
+static ssize_t (*real_recvmsg)(int,struct msghdr*,int);
+static int (*real_sendmmsg)(int,struct mmsghdr*,unsigned int,int);
+static int (*real_recvmmsg)(int,struct mmsghdr*,unsigned int,int,
+			    struct timespec*);
+static ssize_t (*real_splice)(int,loff_t*,int,loff_t*,size_t,unsigned int);
+static int (*real_close)(int);
+static int (*real_close_range)(unsigned int,unsigned int,int);
+static void (*real_closefrom)(int);
+static int (*real_dup)(int);
+static int (*real_dup2)(int,int);
+static int (*real_dup3)(int,int,int);
+static int (*real_fcntl)(int,int,...);
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static RateLimiter *limiter;
+
+  // set while the limiter makes its own calls, which must not be paced
+  // a second time
+static __thread int inside;
+
+  // what each descriptor is, learned with fstat() on first use and
+  // forgotten when it is closed or replaced; the C library closes some
+  // descriptors without coming through here, so only a socket is
+  // taken from the cache as it is, since a call on a socket that is
+  // gone fails with ENOTSOCK and is sent on to the real call, and
+  // anything else is looked at again
+enum { UNKNOWN, SOCKET, DISK, OTHER };
+static unsigned char *types;
+static int ntypes;
+static int files;
+
+static void
+setup()
+{
+    struct rlimit rl;
+    const char *kbps, *burst, *trace, *queue, *ops, *disk;
+    int policy;
+
+      // the limiter's own calls made while setting up, such as closing
+      // a trace file, must not come back here
+    inside = 1;
+    real_send = (ssize_t (*)(int,const void*,size_t,int))
+	dlsym(RTLD_NEXT,"send");
+    real_recv = (ssize_t (*)(int,void*,size_t,int))
+	dlsym(RTLD_NEXT,"recv");
+    real_write = (ssize_t (*)(int,const void*,size_t))
+	dlsym(RTLD_NEXT,"write");
+    real_read = (ssize_t (*)(int,void*,size_t))
+	dlsym(RTLD_NEXT,"read");
+    real_pwrite = (ssize_t (*)(int,const void*,size_t,off_t))
+	dlsym(RTLD_NEXT,"pwrite");
+    real_pread = (ssize_t (*)(int,void*,size_t,off_t))
+	dlsym(RTLD_NEXT,"pread");
+    real_sendfile = (ssize_t (*)(int,int,off_t*,size_t))
+	dlsym(RTLD_NEXT,"sendfile");
+    real_sendmsg = (ssize_t (*)(int,const struct msghdr*,int))
+	dlsym(RTLD_NEXT,"sendmsg");
+    real_recvmsg = (ssize_t (*)(int,struct msghdr*,int))
+	dlsym(RTLD_NEXT,"recvmsg");
+    real_sendmmsg = (int (*)(int,struct mmsghdr*,unsigned int,int))
+	dlsym(RTLD_NEXT,"sendmmsg");
+    real_recvmmsg = (int (*)(int,struct mmsghdr*,unsigned int,int,
+			     struct timespec*))
+	dlsym(RTLD_NEXT,"recvmmsg");
+    real_splice = (ssize_t (*)(int,loff_t*,int,loff_t*,size_t,unsigned int))
+	dlsym(RTLD_NEXT,"splice");
+    real_close = (int (*)(int)) dlsym(RTLD_NEXT,"close");
+    real_close_range = (int (*)(unsigned int,unsigned int,int))
+	dlsym(RTLD_NEXT,"close_range");
+    real_closefrom = (void (*)(int)) dlsym(RTLD_NEXT,"closefrom");
+    real_dup = (int (*)(int)) dlsym(RTLD_NEXT,"dup");
+    real_dup2 = (int (*)(int,int)) dlsym(RTLD_NEXT,"dup2");
+    real_dup3 = (int (*)(int,int,int)) dlsym(RTLD_NEXT,"dup3");
+    real_fcntl = (int (*)(int,int,...)) dlsym(RTLD_NEXT,"fcntl");
+
+    kbps = getenv("RATELIMIT_KBPS");
+    burst = getenv("RATELIMIT_BURST");
+    queue = getenv("RATELIMIT_QUEUE");
+    ops = getenv("RATELIMIT_OPS");
+    disk = getenv("RATELIMIT_FILES");
+    files = disk && atoi(disk) > 0;
+    if (!kbps && !burst && !queue && !ops && !disk &&
+	!getenv("RATELIMIT_SEND_TRACE") && !getenv("RATELIMIT_RECV_TRACE")) {
+	inside = 0;
+	return;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+	ntypes = rl.rlim_cur;
+    else
+	ntypes = 65536;
+    if (ntypes > (1 << 20))
+	ntypes = 1 << 20;
+    types = (unsigned char *) calloc(ntypes,1);
+    if (!types)
+	ntypes = 0;
+
+    limiter = new RateLimiter(kbps ? atoi(kbps) : 0,
+			      burst ? atoi(burst) : 10000);
+    if ((trace = getenv("RATELIMIT_SEND_TRACE")))
+	limiter->set_send_trace(trace);
+    if ((trace = getenv("RATELIMIT_RECV_TRACE")))
+	limiter->set_recv_trace(trace);
+    if (queue && strchr(queue,':')) {
+	policy = Bottleneck::DROPTAIL;
+	if (strncmp(queue,"red:",4) == 0)
+	    policy = Bottleneck::RED;
+	else if (strncmp(queue,"codel:",6) == 0)
+	    policy = Bottleneck::CODEL;
+	limiter->set_queue(policy,atol(strchr(queue,':') + 1));
+    }
+    if (ops)
+	limiter->set_op_rate(atoi(ops));
+    inside = 0;
+}
+
+  // What is this call on, if it should go through the limiter?
+static int
+kind(int fd)
+{
+    struct stat st;
+    int type;
+
+    pthread_once(&once,setup);
+    if (!limiter || inside || fd < 0)
+	return UNKNOWN;
+    if (fd < ntypes &&
+	__atomic_load_n(&types[fd],__ATOMIC_RELAXED) == SOCKET)
+	return SOCKET;
+    type = OTHER;
+    if (fstat(fd,&st) == 0) {
+	if (S_ISSOCK(st.st_mode))
+	    type = SOCKET;
+	else if (files && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+	    type = DISK;
+    }
+    if (fd < ntypes)
+	__atomic_store_n(&types[fd],type,__ATOMIC_RELAXED);
+    return type;
+}
+
+static int
+paced(int fd)
+{
+    return kind(fd) == SOCKET;
+}
+
+static void
+forget(int fd)
+{
+    if (fd >= 0 && fd < ntypes)
+	__atomic_store_n(&types[fd],UNKNOWN,__ATOMIC_RELAXED);
+}
+
+  // A descriptor closed behind our back may have been reused for
+  // something that is not a socket.
+static int
+stale(int fd, ssize_t result)
+{
+    if (result < 0 && errno == ENOTSOCK) {
+	if (fd < ntypes)
+	    __atomic_store_n(&types[fd],OTHER,__ATOMIC_RELAXED);
+	return 1;
+    }
+    return 0;
+}
+
+extern "C" {
+
+ssize_t
+send(int s, const void *buf, size_t len, int flags)
+{
+    ssize_t result;
+
+    if (!paced(s))
+	return real_send(s,buf,len,flags);
+    inside = 1;
+    result = (ssize_t) limiter->send(s,buf,len,flags);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+recv(int s, void *buf, size_t len, int flags)
+{
+    ssize_t result;
+
+    if (!paced(s))
+	return real_recv(s,buf,len,flags);
+    inside = 1;
+    result = (ssize_t) limiter->recv(s,buf,len,flags);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+    ssize_t result;
+    int type;
+
+    type = kind(fd);
+    if (type != SOCKET && type != DISK)
+	return real_write(fd,buf,len);
+    inside = 1;
+    if (type == DISK)
+	result = limiter->write(fd,buf,len);
+    else
+	result = (ssize_t) limiter->send(fd,buf,len,0);
+    inside = 0;
+    if (type == SOCKET && stale(fd,result))
+	return real_write(fd,buf,len);
+    return result;
+}
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+    ssize_t result;
+    int type;
+
+    type = kind(fd);
+    if (type != SOCKET && type != DISK)
+	return real_read(fd,buf,len);
+    inside = 1;
+    if (type == DISK)
+	result = limiter->read(fd,buf,len);
+    else
+	result = (ssize_t) limiter->recv(fd,buf,len,0);
+    inside = 0;
+    if (type == SOCKET && stale(fd,result))
+	return real_read(fd,buf,len);
+    return result;
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    ssize_t result;
+
+    if (kind(fd) != DISK)
+	return real_pwrite(fd,buf,len,offset);
+    inside = 1;
+    result = limiter->pwrite(fd,buf,len,offset);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+pread(int fd, void *buf, size_t len, off_t offset)
+{
+    ssize_t result;
+
+    if (kind(fd) != DISK)
+	return real_pread(fd,buf,len,offset);
+    inside = 1;
+    result = limiter->pread(fd,buf,len,offset);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+sendfile(int out, int in, off_t *offset, size_t count)
+{
+    ssize_t result;
+
+    if (!paced(out))
+	return real_sendfile(out,in,offset,count);
+    inside = 1;
+    result = limiter->sendfile(out,in,offset,count);
+    inside = 0;
+    if (stale(out,result))
+	return real_sendfile(out,in,offset,count);
+    return result;
+}
+
+ssize_t
+sendmsg(int s, const struct msghdr *msg, int flags)
+{
+    ssize_t result;
+
+    if (!paced(s))
+	return real_sendmsg(s,msg,flags);
+    inside = 1;
+    result = limiter->sendmsg(s,msg,flags);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+recvmsg(int s, struct msghdr *msg, int flags)
+{
+    ssize_t result;
+
+    if (!paced(s))
+	return real_recvmsg(s,msg,flags);
+    inside = 1;
+    result = limiter->recvmsg(s,msg,flags);
+    inside = 0;
+    return result;
+}
+
+int
+sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    int result;
+
+    if (!paced(s))
+	return real_sendmmsg(s,msgs,vlen,flags);
+    inside = 1;
+    result = limiter->sendmmsg(s,msgs,vlen,flags);
+    inside = 0;
+    return result;
+}
+
+int
+recvmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags,
+	 struct timespec *timeout)
+{
+    int result;
+
+    if (!paced(s))
+	return real_recvmmsg(s,msgs,vlen,flags,timeout);
+    inside = 1;
+    result = limiter->recvmmsg(s,msgs,vlen,flags,timeout);
+    inside = 0;
+    return result;
+}
+
+ssize_t
+splice(int in, loff_t *inoff, int out, loff_t *outoff, size_t len,
+       unsigned int flags)
+{
+    ssize_t result;
+
+    if (!paced(in) && !paced(out))
+	return real_splice(in,inoff,out,outoff,len,flags);
+    inside = 1;
+    result = limiter->splice(in,inoff,out,outoff,len,flags);
+    inside = 0;
+    return result;
+}
+
+int
+close(int fd)
+{
+    int type, result;
+
+      // the limiter closing a socket of its own, or a file while it is
+      // set up
+    if (inside)
+	return real_close(fd);
+    pthread_once(&once,setup);
+    type = UNKNOWN;
+    if (fd >= 0 && fd < ntypes)
+	type = __atomic_load_n(&types[fd],__ATOMIC_RELAXED);
+    forget(fd);
+
+      // what the limiter holds for the descriptor must go with it, or
+      // the next to get its number inherits it
+    if (!limiter || (type != SOCKET && type != DISK))
+	return real_close(fd);
+    inside = 1;
+    result = limiter->close(fd);
+    inside = 0;
+    return result;
+}
+
+  // Let go of what the limiter holds for a range of descriptors being
+  // closed.  Marking them close-on-exec closes nothing, and a table
+  // being unshared first is no longer the one the limiter knows.
+static void
+close_all(unsigned int first, unsigned int last, int flags)
+{
+    unsigned int fd;
+    int type;
+
+    if (flags & (CLOSE_RANGE_CLOEXEC|CLOSE_RANGE_UNSHARE))
+	return;
+    for (fd = first; fd <= last && fd < (unsigned int) ntypes; fd++) {
+	type = __atomic_load_n(&types[fd],__ATOMIC_RELAXED);
+	forget(fd);
+	if (limiter && (type == SOCKET || type == DISK)) {
+	    inside = 1;
+	    limiter->close(fd);
+	    inside = 0;
+	}
+    }
+}
+
+int
+close_range(unsigned int first, unsigned int last, int flags)
+{
+    if (inside)
+	return real_close_range(first,last,flags);
+    pthread_once(&once,setup);
+    close_all(first,last,flags);
+    return real_close_range(first,last,flags);
+}
+
+void
+closefrom(int first)
+{
+    if (inside || first < 0) {
+	real_closefrom(first);
+	return;
+    }
+    pthread_once(&once,setup);
+    close_all(first,~0U,0);
+    real_closefrom(first);
+}
+
+int
+dup(int oldfd)
+{
+    int fd;
+
+    pthread_once(&once,setup);
+    fd = real_dup(oldfd);
+    forget(fd);
+    return fd;
+}
+
+int
+dup2(int oldfd, int newfd)
+{
+    pthread_once(&once,setup);
+    forget(newfd);
+    return real_dup2(oldfd,newfd);
+}
+
+int
+dup3(int oldfd, int newfd, int flags)
+{
+    pthread_once(&once,setup);
+    forget(newfd);
+    return real_dup3(oldfd,newfd,flags);
+}
+
+int
+fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    void *arg;
+    int result;
+
+    va_start(ap,cmd);
+    arg = va_arg(ap,void *);
+    va_end(ap);
+    if (!inside)
+	pthread_once(&once,setup);
+    result = real_fcntl(fd,cmd,arg);
+    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+	forget(result);
+    return result;
+}
+
+}
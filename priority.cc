@@ -0,0 +1,145 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include "priority.h"
+#include "timespec.h"
+
+using namespace std;
+
+Priority::Priority(int classes)
+{
+    struct timespec zero;
+
+    classes_ = (classes > 0) ? classes : 1;
+    zero.tv_sec = 0;
+    zero.tv_nsec = 0;
+    next_.assign(classes_,zero);
+    guaranteed_.assign(classes_,zero);
+    share_.assign(classes_,0);
+    extra_.assign(classes_,0);
+}
+
+void
+Priority::set_guarantee(int cls, double share)
+{
+    if (cls < 0 || cls >= classes_)
+	return;
+    share_[cls] = (share > 0 && share <= 1) ? share : 0;
+}
+
+void
+Priority::set_class(int fd, int cls)
+{
+    sockets_[fd] = cls;
+}
+
+int
+Priority::get_class(int fd)
+{
+    map<int,int>::iterator i;
+
+    i = sockets_.find(fd);
+    if (i == sockets_.end())
+	return classes_ - 1;
+    return i->second;
+}
+
+void
+Priority::forget(int fd)
+{
+    sockets_.erase(fd);
+}
+
+double
+Priority::schedule(int cls, struct timespec *now, double duration)
+{
+    struct timespec end;
+    int i, top;
+
+      // a bypassing chunk goes now, and everyone else makes room
+    if (cls == BYPASS) {
+	for (i = 0; i < classes_; i++) {
+	    if (timespec_before(&next_[i],now))
+		next_[i] = *now;
+	    timespec_add(&next_[i],duration);
+	}
+	return 0;
+    }
+    if (cls < 0)
+	cls = 0;
+    if (cls >= classes_)
+	cls = classes_ - 1;
+
+      // spend what the class was given back first
+    if (duration >= extra_[cls]) {
+	duration -= extra_[cls];
+	extra_[cls] = 0;
+    } else {
+	extra_[cls] -= duration;
+	duration = 0;
+    }
+
+      // a chunk within its class's guaranteed share goes in class 0
+    top = cls;
+    if (share_[cls] > 0 && !timespec_before(now,&guaranteed_[cls])) {
+	top = 0;
+	guaranteed_[cls] = *now;
+	timespec_add(&guaranteed_[cls],duration / share_[cls]);
+    }
+
+      // take my time behind my own and higher classes
+    end = next_[top];
+    if (timespec_before(&end,now))
+	end = *now;
+    timespec_add(&end,duration);
+    next_[top] = end;
+
+      // push back the lower classes, keeping my class in order
+    for (i = top + 1; i < classes_; i++) {
+	if (timespec_before(&next_[i],now))
+	    next_[i] = *now;
+	timespec_add(&next_[i],duration);
+    }
+    if (timespec_before(&next_[cls],&end))
+	next_[cls] = end;
+
+    return timespec_elapsed(&end,now);
+}
+
+void
+Priority::credit(int cls, double duration)
+{
+    if (cls < 0)
+	cls = 0;
+    if (cls >= classes_)
+	cls = classes_ - 1;
+    extra_[cls] += duration;
+}
+
+double
+Priority::delay(int cls, struct timespec *now)
+{
+    struct timespec *start;
+
+    if (cls == BYPASS)
+	return 0;
+    if (cls < 0)
+	cls = 0;
+    if (cls >= classes_)
+	cls = classes_ - 1;
+    start = &next_[cls];
+    if (share_[cls] > 0 && !timespec_before(now,&guaranteed_[cls]))
+	start = &next_[0];
+    return timespec_before(now,start) ? timespec_elapsed(start,now) : 0;
+}
+
+void
+Priority::horizon(struct timespec *t)
+{
+    int i;
+
+    *t = next_[0];
+    for (i = 1; i < classes_; i++)
+	if (timespec_before(t,&next_[i]))
+	    *t = next_[i];
+}
@@ -0,0 +1,78 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef priority_h
+#define priority_h
+
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+// A Priority divides the sending rate between strict-priority traffic
+// classes, numbered from 0, the highest.  Each class keeps its own
+// timeline.  A chunk waits only behind chunks of its own class and of
+// higher classes, so a small message of a high class can jump ahead of
+// seconds of scheduled bulk data.  Each chunk pushes back the timelines
+// of all lower classes by its duration, so that the classes together
+// still keep to the rate.  Chunks that were already given a time keep
+// it, so the rate can be exceeded briefly, by at most what the lower
+// classes had scheduled ahead.
+
+// A class can be guaranteed a share of the rate, so that it is not
+// starved by the classes above it.  A chunk within its class's share
+// is scheduled as if it were in class 0, and pushes back every other
+// class.
+
+// Chunks sent in the BYPASS class are not delayed at all.  They still
+// push back every class, so they count against the rate.
+
+// A Priority is not thread safe; the rate limiter only calls it while
+// holding its own lock.
+
+class Priority {
+ public:
+    enum { BYPASS = -1, SOCKET = -2 };
+
+      // Create a number of classes.
+    Priority(int);
+
+      // Guarantee a class a share of the rate, between 0 and 1.
+    void set_guarantee(int,double);
+
+      // Set the class of a socket.  Sockets are in the lowest class
+      // unless set otherwise.
+    void set_class(int,int);
+
+      // Get the class of a socket.
+    int get_class(int);
+
+      // Forget a socket, when it is closed.
+    void forget(int);
+
+      // Schedule a chunk of a class that takes a duration in seconds,
+      // given the current time, and return how long to wait before
+      // sending it.
+    double schedule(int,struct timespec*,double);
+
+      // Give a class back a duration in seconds, for a chunk that was
+      // scheduled but not sent; the class's next chunks take less time.
+    void credit(int,double);
+
+      // Get how long a chunk of a class would wait before its time
+      // starts, without scheduling it.
+    double delay(int,struct timespec*);
+
+      // Get the latest time scheduled for any class.
+    void horizon(struct timespec*);
+
+ private:
+    int classes_;
+    std::vector<struct timespec> next_;
+    std::vector<struct timespec> guaranteed_;
+    std::vector<double> share_;
+    std::vector<double> extra_;
+    std::map<int,int> sockets_;
+};
+
+#endif /*priority_h*/
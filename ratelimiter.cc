@@ -2,168 +2,2395 @@
 // This program is licensed under the GPL; see LICENSE for details.
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <math.h>
 #include <netinet/ip.h>
+#include <poll.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <iostream>
 
 using namespace std;
 
+#include "concurrency.h"
+#include "fairqueue.h"
+#include "gcra.h"
+#include "lease.h"
+#include "priority.h"
 #include "ratelimiter.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "shared.h"
+#include "timespec.h"
+#include "trace.h"
+#include "zerocopy.h"
+
+  // set while a call moves data without sleeping; a wait that would
+  // have slept pushes out the time kept here instead
+static __thread int64_t *deferral;
+
+  // set while a call holds a concurrency slot whose latency is
+  // measured; the time its system calls take is added here, and its
+  // waits for its turn are not
+static __thread int64_t *busy;
+
+  // the class and queue slot of the chunk a thread last scheduled on
+  // the limiter's own timeline, so that bytes it does not send are
+  // given back where they were charged
+static __thread struct {
+    RateLimiter *limiter;
+    int cls;
+    struct timespec finish;
+} scheduled;
+
+  // how long a send waits for zero-copy completions before it looks
+  // again at whether it was cancelled, in milliseconds
+static const int reap_round = 10;
+
+static const uint32_t saved_magic = 0x524c5331;
+static const uint32_t saved_version = 1;
+
+  // no process has more sockets than the kernel's default ceiling on
+  // descriptors, so a state with more caps is not believed
+static const uint32_t saved_maxcaps = 1 << 20;
+
+  // the state of a limiter, followed by a record for each socket cap;
+  // times are in nanoseconds since the epoch, 0 when there is none
+struct saved {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t ncaps;
+    int64_t send;
+    int64_t recv;
+    double sendextra;
+    double recvextra;
+    int64_t sendop;
+    int64_t recvop;
+    int64_t sendtat;
+    int64_t recvtat;
+};
+
+struct saved_cap {
+    int32_t fd;
+    int32_t kernel;
+    int64_t rate;
+    int64_t next;
+};
+
+static size_t
+iovlen(const struct msghdr *msg)
+{
+    size_t size;
+    int i;
+
+    size = 0;
+    for (i = 0; i < (int) msg->msg_iovlen; i++)
+	size += msg->msg_iov[i].iov_len;
+    return size;
+}
+
+  // set a time from nanoseconds since the epoch, where 0 is no time
+static void
+to_time(struct timespec *t, int64_t nsec)
+{
+    t->tv_sec = nsec / 1000000000;
+    t->tv_nsec = nsec % 1000000000;
+}
+
+  // move all of a buffer over a stream socket
+static int
+transfer(int s, char *buf, size_t len, int out)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if (out)
+	    n = ::send(s,buf,len,MSG_NOSIGNAL);
+	else
+	    n = ::recv(s,buf,len,MSG_WAITALL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	} else if (n == 0) {
+	    errno = ECONNRESET;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static void
+count_busy(struct timespec *t1, struct timespec *t2)
+{
+    if (busy)
+	*busy += (int64_t) (t2->tv_sec - t1->tv_sec) * 1000000000 +
+	    t2->tv_nsec - t1->tv_nsec;
+}
+
+  // a concurrency slot, held for the length of one call; its latency,
+  // if asked for, is the time spent in the calls that moved data
+struct RateLimiter::inflight {
+    ConcurrencyLimit *limit;
+    int64_t spent;
+    int64_t *outer;
+    int measure;
+    int failed;
+
+    inflight(ConcurrencyLimit *l, int flags, int m) {
+	limit = l;
+	measure = m;
+	failed = 0;
+	spent = 0;
+	if (!limit)
+	    return;
+	if (limit->acquire(!(flags & MSG_DONTWAIT)) < 0) {
+	    failed = 1;
+	    return;
+	}
+	outer = busy;
+	if (measure)
+	    busy = &spent;
+    }
+    ~inflight() {
+	if (!limit || failed)
+	    return;
+	busy = outer;
+	limit->release(measure && spent > 0 ? spent : -1);
+    }
+};
+
+  // a slice of the sending timeline leased by one thread
+struct RateLimiter::slice {
+    RateLimiter *owner;
+    struct timespec next;
+    double left;
+    double extra;
+    slice *prev;
+    slice *link;
+};
+
+  // a pipe kept by one thread for relaying between sockets
+struct RateLimiter::relaypipe {
+    RateLimiter *owner;
+    int fd[2];
+    size_t size;
+    relaypipe *prev;
+    relaypipe *link;
+};
 
 RateLimiter::RateLimiter()
 {
       // default rate is unlimited
-    rate_ = 0;
-    maxburst_ = 10000;
+    init(0,10000);
+}
+
+RateLimiter::RateLimiter(int r)
+{
+    init(r,10000);
+}
+
+RateLimiter::RateLimiter(int r, int maxburst)
+{
+    init(r,maxburst);
+}
+
+RateLimiter::~RateLimiter()
+{
+    struct timespec pause;
+
+      // wake the waiting calls and let them leave before tearing down
+    stop();
+    pause.tv_sec = 0;
+    pause.tv_nsec = 100000;
+    while (__atomic_load_n(&waiters_,__ATOMIC_SEQ_CST) > 0)
+	nanosleep(&pause,NULL);
+    pthread_mutex_lock(&mutex_);
+    pthread_mutex_unlock(&mutex_);
+
+    delete sendtrace_;
+    delete recvtrace_;
+    delete senddelay_;
+    delete recvdelay_;
+    delete queue_;
+    delete shared_;
+    delete shards_;
+    delete sendgcra_;
+    delete recvgcra_;
+    delete concurrency_;
+    delete fair_;
+    delete priority_;
+    delete zerocopy_;
+    delete lease_;
+    delete scheduler_;
+    if (slicing_) {
+	pthread_key_delete(slicekey_);
+	while (slices_) {
+	    slice *sl = slices_;
+	    slices_ = sl->link;
+	    delete sl;
+	}
+    }
+    if (piping_) {
+	pthread_key_delete(pipekey_);
+	while (pipes_) {
+	    relaypipe *p = pipes_;
+	    pipes_ = p->link;
+	    ::close(p->fd[0]);
+	    ::close(p->fd[1]);
+	    delete p;
+	}
+    }
+    pthread_mutex_destroy(&waitlock_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void
+RateLimiter::init(int r, int maxburst)
+{
+    rate_ = r*1000;
+    maxburst_ = maxburst;
     clock_gettime(CLOCK_REALTIME,&send_);
     clock_gettime(CLOCK_REALTIME,&recv_);
+    sendextra_ = 0;
+    recvextra_ = 0;
+    sendtrace_ = NULL;
+    recvtrace_ = NULL;
+    senddelay_ = NULL;
+    recvdelay_ = NULL;
+    queue_ = NULL;
+    shared_ = NULL;
+    shards_ = NULL;
+    sendgcra_ = NULL;
+    recvgcra_ = NULL;
+    concurrency_ = NULL;
+    fair_ = NULL;
+    priority_ = NULL;
+    lease_ = NULL;
+    capped_ = 0;
+    offload_ = 0;
+    zerocopy_ = NULL;
+    zcmin_ = 0;
+    maxdelay_ = 0;
+    opstep_ = 0;
+    sendop_ = 0;
+    recvop_ = 0;
+    slice_ = 0;
+    slicing_ = 0;
+    slices_ = NULL;
+    piping_ = 0;
+    pipes_ = NULL;
+    scheduler_ = NULL;
+    scheduling_ = 0;
+    gen_ = 0;
+    waiters_ = 0;
+    stopped_ = 0;
+    started_ = 0;
     pthread_mutex_init(&mutex_, NULL);
+    pthread_mutex_init(&waitlock_, NULL);
+}
+
+void
+RateLimiter::set_rate(int r)
+{
+    struct timespec now, left;
+    int old;
+
+    old = rate_;
+    rate_ = 1000*r;
+    if (shared_)
+	shared_->set_rate(rate_);
+    if (shards_)
+	shards_->set_rate(rate_);
+    if (sendgcra_) {
+	sendgcra_->set_rate(rate_,maxburst_);
+	recvgcra_->set_rate(rate_,maxburst_);
+    }
+    if (old <= 0 || rate_ == old)
+	return;
+
+      // time already booked on the timelines was booked at the old
+      // rate, so stretch or shrink it to the new one
+    pthread_mutex_lock(&mutex_);
+    clock_gettime(CLOCK_REALTIME,&now);
+    if (!sendtrace_ && time_less(&now,&send_)) {
+	left = now;
+	time_add(&left,rate_ ? time_diff2(&send_,&now) * old / rate_ : 0);
+	time_set(&send_,&left);
+    }
+    if (!recvtrace_ && time_less(&now,&recv_)) {
+	left = now;
+	time_add(&left,rate_ ? time_diff2(&recv_,&now) * old / rate_ : 0);
+	time_set(&recv_,&left);
+    }
+    pthread_mutex_unlock(&mutex_);
+
+      // and so were the waits of calls already sleeping
+    wake();
+}
+
+void
+RateLimiter::stop()
+{
+    __atomic_store_n(&stopped_,1,__ATOMIC_SEQ_CST);
+    wake();
+    pthread_mutex_lock(&mutex_);
+    if (fair_)
+	fair_->cancel(-1);
+    if (concurrency_)
+	concurrency_->stop();
+    if (lease_)
+	lease_->stop();
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+RateLimiter::cancel(int s)
+{
+      // a call waiting on the socket is cancelled if it started waiting
+      // before this generation
+    pthread_mutex_lock(&waitlock_);
+    cancels_[s] = __atomic_add_fetch(&gen_,1,__ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&waitlock_);
+    wake();
+    pthread_mutex_lock(&mutex_);
+    if (fair_)
+	fair_->cancel(s);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+RateLimiter::wake()
+{
+      // every waiter sleeps on the generation, or with the scheduler,
+      // so a new one wakes them all to look at what changed
+    __atomic_add_fetch(&gen_,1,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiters_,__ATOMIC_SEQ_CST) > 0) {
+	syscall(SYS_futex,&gen_,FUTEX_WAKE_PRIVATE,INT_MAX,NULL,NULL,0);
+	if (__atomic_load_n(&scheduler_,__ATOMIC_SEQ_CST))
+	    scheduler_->wake();
+    }
+}
+
+int
+RateLimiter::cancelled(int s, unsigned int since)
+{
+    map<int,unsigned int>::iterator i;
+    int result;
+
+    result = 0;
+    pthread_mutex_lock(&waitlock_);
+    i = cancels_.find(s);
+    if (i != cancels_.end() && (int) (i->second - since) > 0)
+	result = 1;
+    pthread_mutex_unlock(&waitlock_);
+    return result;
+}
+
+void
+RateLimiter::set_rate(int r, int m)
+{
+    maxburst_ = m;
+    set_rate(r);
+}
+
+void
+RateLimiter::set_max_delay(int usec)
+{
+    __atomic_store_n(&maxdelay_,usec > 0 ? (int64_t) usec * 1000 : 0,
+		     __ATOMIC_RELAXED);
+}
+
+void
+RateLimiter::set_op_rate(int ops)
+{
+    __atomic_store_n(&opstep_,ops > 0 ? 1000000000 / (int64_t) ops : 0,
+		     __ATOMIC_RELAXED);
+}
+
+int
+RateLimiter::set_socket_rate(int s, int kbps)
+{
+    map<int,cap>::iterator i;
+    int64_t rate;
+    int kernel;
+
+    rate = (int64_t) kbps * 1000;
+    kernel = 0;
+    pthread_mutex_lock(&mutex_);
+    i = caps_.find(s);
+    if (i != caps_.end()) {
+	if (i->second.kernel)
+	    offload(s,0);
+	else
+	    capped_--;
+	caps_.erase(i);
+    }
+    if (rate > 0) {
+	cap &c = caps_[s];
+	c.rate = rate;
+	c.next = 0;
+	c.kernel = offload_ && offload(s,rate);
+	if (!c.kernel)
+	    capped_++;
+	kernel = c.kernel;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return kernel;
+}
+
+void
+RateLimiter::set_offload(int on)
+{
+    map<int,cap>::iterator i;
+
+    pthread_mutex_lock(&mutex_);
+    offload_ = on;
+    for (i = caps_.begin(); i != caps_.end(); i++) {
+	if (on && !i->second.kernel && offload(i->first,i->second.rate)) {
+	    i->second.kernel = 1;
+	    capped_--;
+	} else if (!on && i->second.kernel) {
+	    offload(i->first,0);
+	    i->second.kernel = 0;
+	    i->second.next = 0;
+	    capped_++;
+	}
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+RateLimiter::offload(int s, int64_t rate)
+{
+    unsigned int pacing;
+    socklen_t len;
+    int proto;
+
+      // TCP paces itself to the cap without the fq queueing discipline,
+      // which we cannot count on, so other sockets are left to us
+    len = sizeof(proto);
+    if (getsockopt(s,SOL_SOCKET,SO_PROTOCOL,&proto,&len) < 0 ||
+	proto != IPPROTO_TCP)
+	return 0;
+
+      // the kernel takes bytes per second, and all ones for no cap
+    pacing = ~0U;
+    if (rate > 0 && rate / 8 < ~0U)
+	pacing = (unsigned int) (rate / 8);
+    return setsockopt(s,SOL_SOCKET,SO_MAX_PACING_RATE,&pacing,
+		      sizeof(pacing)) == 0;
+}
+
+int64_t
+RateLimiter::take_cap(int s, size_t size, int64_t bound)
+{
+    map<int,cap>::iterator i;
+    struct timespec t;
+    int64_t now, start, wait;
+
+      // a socket has a timeline of its own, like the limiter's
+    clock_gettime(CLOCK_REALTIME,&t);
+    now = (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+    wait = 0;
+    pthread_mutex_lock(&mutex_);
+    i = caps_.find(s);
+    if (i != caps_.end() && !i->second.kernel) {
+	start = (i->second.next > now) ? i->second.next : now;
+	if (bound >= 0 && start - now > bound) {
+	    wait = -1;
+	} else {
+	    i->second.next = start +
+		(int64_t) ((double) size * 8e9 / i->second.rate);
+	    wait = i->second.next - now;
+	}
+    }
+    pthread_mutex_unlock(&mutex_);
+    return wait;
+}
+
+void
+RateLimiter::give_cap(int s, size_t size)
+{
+    map<int,cap>::iterator i;
+
+    pthread_mutex_lock(&mutex_);
+    i = caps_.find(s);
+    if (i != caps_.end() && !i->second.kernel)
+	i->second.next -= (int64_t) ((double) size * 8e9 / i->second.rate);
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+RateLimiter::set_zerocopy(size_t min)
+{
+    ZeroCopy *zerocopy, *old;
+
+      // a sender may still be waiting for the kernel to finish with
+      // its buffer
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    zerocopy = (min > 0) ? new ZeroCopy() : NULL;
+    pthread_mutex_lock(&mutex_);
+    old = zerocopy_;
+    zerocopy_ = zerocopy;
+    zcmin_ = min;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+void
+RateLimiter::set_scheduler(int on)
+{
+      // the scheduler is kept once made, since a waiter may still be
+      // sleeping with it
+    pthread_mutex_lock(&mutex_);
+    if (on && !scheduler_)
+	__atomic_store_n(&scheduler_,new Scheduler(),__ATOMIC_SEQ_CST);
+    __atomic_store_n(&scheduling_,on ? 1 : 0,__ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mutex_);
+
+      // and the sleepers move to the new way of sleeping
+    wake();
+}
+
+int
+RateLimiter::set_concurrency(int initial, int max)
+{
+    ConcurrencyLimit *limit, *old;
+
+      // a call may still hold a slot of the old limit
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    limit = NULL;
+    if (initial > 0)
+	limit = new ConcurrencyLimit(initial,max);
+
+    pthread_mutex_lock(&mutex_);
+    old = concurrency_;
+    concurrency_ = limit;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+int
+RateLimiter::get_concurrency()
+{
+    return concurrency_ ? concurrency_->limit() : 0;
+}
+
+int
+RateLimiter::set_fair(int on)
+{
+    FairQueue *fair, *old;
+
+      // a sender may still be waiting for its turn in the old queue
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    fair = on ? new FairQueue() : NULL;
+    pthread_mutex_lock(&mutex_);
+    old = fair_;
+    fair_ = fair;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+int
+RateLimiter::set_weight(int s, int weight)
+{
+      // turning fair sharing on is a change of algorithm, which a
+      // call already paced without it would not see
+    pthread_mutex_lock(&mutex_);
+    if (!fair_) {
+	if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	    pthread_mutex_unlock(&mutex_);
+	    errno = EBUSY;
+	    return -1;
+	}
+	fair_ = new FairQueue();
+    }
+    fair_->set_weight(s,weight);
+    pthread_mutex_unlock(&mutex_);
+    return 0;
+}
+
+void
+RateLimiter::set_classes(int classes)
+{
+    Priority *priority, *old;
+
+    priority = (classes > 0) ? new Priority(classes) : NULL;
+    pthread_mutex_lock(&mutex_);
+    old = priority_;
+    priority_ = priority;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+}
+
+void
+RateLimiter::set_guarantee(int cls, double share)
+{
+    pthread_mutex_lock(&mutex_);
+    if (priority_)
+	priority_->set_guarantee(cls,share);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+RateLimiter::set_class(int s, int cls)
+{
+    pthread_mutex_lock(&mutex_);
+    if (priority_)
+	priority_->set_class(s,cls);
+    pthread_mutex_unlock(&mutex_);
+}
+
+double
+RateLimiter::get_fairness()
+{
+    double fairness;
+
+    pthread_mutex_lock(&mutex_);
+    fairness = fair_ ? fair_->fairness() : 1;
+    pthread_mutex_unlock(&mutex_);
+    return fairness;
+}
+
+int
+RateLimiter::set_algorithm(int algorithm)
+{
+    GcraEngine *send, *recv, *oldsend, *oldrecv;
+
+      // the engines are used without the lock, so a call may still be
+      // reserving from the old ones
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    send = NULL;
+    recv = NULL;
+    if (algorithm == GCRA) {
+	send = new GcraEngine(rate_,maxburst_);
+	recv = new GcraEngine(rate_,maxburst_);
+    }
+
+    pthread_mutex_lock(&mutex_);
+    oldsend = sendgcra_;
+    oldrecv = recvgcra_;
+    sendgcra_ = send;
+    recvgcra_ = recv;
+    pthread_mutex_unlock(&mutex_);
+    delete oldsend;
+    delete oldrecv;
+    return 0;
+}
+
+int
+RateLimiter::share(const char *name)
+{
+    SharedTimeline *shared, *old;
+
+      // the timeline is used without the lock, so a call may still be
+      // reserving from the old one
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    shared = new SharedTimeline();
+    if (shared->open(name,rate_) < 0) {
+	delete shared;
+	return -1;
+    }
+    pthread_mutex_lock(&mutex_);
+    old = shared_;
+    shared_ = shared;
+    rate_ = shared_->get_rate();
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+int
+RateLimiter::save(const char *path)
+{
+    vector<char> buf, tmp;
+    const char *slash;
+    char *mem;
+    int fd, error;
+
+      // the state is written to a file of its own and renamed over the
+      // old one, so a crash leaves one or the other whole
+    pack(buf);
+    tmp.assign(path,path + strlen(path));
+    tmp.insert(tmp.end(),".XXXXXX",".XXXXXX" + 8);
+    fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+	return -1;
+    if (ftruncate(fd,buf.size()) < 0)
+	goto failed;
+    mem = (char *) mmap(NULL,buf.size(),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (mem == MAP_FAILED)
+	goto failed;
+
+      // the magic number goes in last, so that a file cut short is
+      // never taken for a good one
+    memcpy(mem + sizeof(uint32_t),&buf[sizeof(uint32_t)],
+	   buf.size() - sizeof(uint32_t));
+    __atomic_store_n((uint32_t *) mem,saved_magic,__ATOMIC_RELEASE);
+    munmap(mem,buf.size());
+    if (fsync(fd) < 0)
+	goto failed;
+    ::close(fd);
+    if (rename(&tmp[0],path) < 0) {
+	error = errno;
+	unlink(&tmp[0]);
+	errno = error;
+	return -1;
+    }
+
+      // the rename is only lasting once the directory is on disk too
+    slash = strrchr(path,'/');
+    if (!slash)
+	tmp.assign(1,'.');
+    else if (slash == path)
+	tmp.assign(1,'/');
+    else
+	tmp.assign(path,slash);
+    tmp.push_back('\0');
+    fd = open(&tmp[0],O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+    if (fsync(fd) < 0) {
+	error = errno;
+	::close(fd);
+	errno = error;
+	return -1;
+    }
+    ::close(fd);
+    return 0;
+
+failed:
+    error = errno;
+    ::close(fd);
+    unlink(&tmp[0]);
+    errno = error;
+    return -1;
 }
 
-RateLimiter::RateLimiter(int r)
-{
-    rate_ = r*1000;
-    maxburst_ = 10000;
-    clock_gettime(CLOCK_REALTIME,&send_);
-    clock_gettime(CLOCK_REALTIME,&recv_);
-    pthread_mutex_init(&mutex_, NULL);
+int
+RateLimiter::restore(const char *path)
+{
+    struct stat st;
+    char *mem;
+    int fd, result;
+
+    fd = open(path,O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd,&st) < 0) {
+	::close(fd);
+	return -1;
+    }
+    if (st.st_size < (off_t) sizeof(saved)) {
+	::close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+    mem = (char *) mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+	return -1;
+    result = unpack(mem,st.st_size);
+    munmap(mem,st.st_size);
+    return result;
+}
+
+int
+RateLimiter::hand_off(int s)
+{
+    vector<char> buf;
+
+    pack(buf);
+    return transfer(s,&buf[0],buf.size(),1);
+}
+
+int
+RateLimiter::take_over(int s)
+{
+    vector<char> buf;
+    struct saved st;
+
+      // the header says how much follows
+    if (transfer(s,(char *) &st,sizeof(st),0) < 0)
+	return -1;
+    if (st.magic != saved_magic || st.ncaps > saved_maxcaps ||
+	st.size != sizeof(st) + (size_t) st.ncaps * sizeof(saved_cap)) {
+	errno = EINVAL;
+	return -1;
+    }
+    buf.resize(st.size);
+    memcpy(&buf[0],&st,sizeof(st));
+    if (transfer(s,&buf[sizeof(st)],st.size - sizeof(st),0) < 0)
+	return -1;
+    return unpack(&buf[0],buf.size());
+}
+
+void
+RateLimiter::pack(vector<char> &buf)
+{
+    map<int,cap>::iterator i;
+    struct saved *st;
+    struct saved_cap *sc;
+
+    pthread_mutex_lock(&mutex_);
+    buf.assign(sizeof(saved) + caps_.size() * sizeof(saved_cap),0);
+    st = (saved *) &buf[0];
+    st->magic = saved_magic;
+    st->version = saved_version;
+    st->size = buf.size();
+    st->ncaps = caps_.size();
+    st->send = (int64_t) send_.tv_sec * 1000000000 + send_.tv_nsec;
+    st->recv = (int64_t) recv_.tv_sec * 1000000000 + recv_.tv_nsec;
+    st->sendextra = sendextra_;
+    st->recvextra = recvextra_;
+    st->sendop = __atomic_load_n(&sendop_,__ATOMIC_RELAXED);
+    st->recvop = __atomic_load_n(&recvop_,__ATOMIC_RELAXED);
+    st->sendtat = sendgcra_ ? sendgcra_->get_tat() : 0;
+    st->recvtat = recvgcra_ ? recvgcra_->get_tat() : 0;
+    sc = (saved_cap *) (st + 1);
+    for (i = caps_.begin(); i != caps_.end(); i++, sc++) {
+	sc->fd = i->first;
+	sc->kernel = i->second.kernel;
+	sc->rate = i->second.rate;
+	sc->next = i->second.next;
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+RateLimiter::unpack(const char *buf, size_t len)
+{
+    map<int,cap>::iterator i;
+    const struct saved *st;
+    const struct saved_cap *sc;
+    unsigned int n;
+    cap c;
+
+      // only a whole state in a version we know will do
+    st = (const saved *) buf;
+    if (len < sizeof(saved) || st->magic != saved_magic ||
+	st->version != saved_version || st->size != len ||
+	st->ncaps > saved_maxcaps ||
+	len != sizeof(saved) + (size_t) st->ncaps * sizeof(saved_cap)) {
+	errno = EINVAL;
+	return -1;
+    }
+    sc = (const saved_cap *) (st + 1);
+    for (n = 0; n < st->ncaps; n++)
+	if (sc[n].fd < 0 || sc[n].rate < 0) {
+	    errno = EINVAL;
+	    return -1;
+	}
+
+    pthread_mutex_lock(&mutex_);
+    to_time(&send_,st->send);
+    to_time(&recv_,st->recv);
+    sendextra_ = st->sendextra;
+    recvextra_ = st->recvextra;
+    __atomic_store_n(&sendop_,st->sendop,__ATOMIC_RELAXED);
+    __atomic_store_n(&recvop_,st->recvop,__ATOMIC_RELAXED);
+    if (sendgcra_ && st->sendtat)
+	sendgcra_->set_tat(st->sendtat);
+    if (recvgcra_ && st->recvtat)
+	recvgcra_->set_tat(st->recvtat);
+
+      // a cap goes back to the kernel only if this limiter offloads and
+      // the kernel takes it on the socket as it is now; otherwise the
+      // limiter paces it
+    sc = (const saved_cap *) (st + 1);
+    for (n = 0; n < st->ncaps; n++, sc++) {
+	i = caps_.find(sc->fd);
+	if (i != caps_.end() && !i->second.kernel)
+	    capped_--;
+	c.rate = sc->rate;
+	c.next = sc->next;
+	c.kernel = offload_ && offload(sc->fd,sc->rate);
+	if (!c.kernel && i != caps_.end() && i->second.kernel)
+	    offload(sc->fd,0);
+	caps_[sc->fd] = c;
+	if (!c.kernel)
+	    capped_++;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return 0;
+}
+
+int
+RateLimiter::set_lease(LeaseSource *source, size_t size, int fallback)
+{
+    LeaseBudget *lease, *old;
+
+      // a sender may still be taking from or giving back to the old
+      // lease
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    lease = NULL;
+    if (source)
+	lease = new LeaseBudget(source,size,fallback);
+
+    pthread_mutex_lock(&mutex_);
+    old = lease_;
+    lease_ = lease;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+void
+RateLimiter::set_thread_lease(int usec)
+{
+    pthread_mutex_lock(&mutex_);
+    if (!slicing_ && usec > 0 &&
+	pthread_key_create(&slicekey_,slice_done) == 0)
+	slicing_ = 1;
+    if (slicing_)
+	slice_ = (double) usec / 1000000;
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+RateLimiter::set_shards(int mode)
+{
+    ShardedBudget *shards, *old;
+
+      // the shards are used without the lock, so a call may still be
+      // reserving from the old ones
+    if (__atomic_load_n(&started_,__ATOMIC_SEQ_CST)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    shards = NULL;
+    if (mode)
+	shards = new ShardedBudget(mode,rate_);
+
+    pthread_mutex_lock(&mutex_);
+    old = shards_;
+    shards_ = shards;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+void
+RateLimiter::slice_done(void *arg)
+{
+    slice *sl = (slice *) arg;
+    RateLimiter *l = sl->owner;
+    struct timespec now, end;
+
+      // give back the rest of the slice if nobody has leased after it
+    pthread_mutex_lock(&l->mutex_);
+    l->time_set(&end,&sl->next);
+    l->time_add(&end,sl->left);
+    if (sl->left > 0 && !l->time_less(&l->send_,&end) &&
+	!l->time_less(&end,&l->send_)) {
+	clock_gettime(CLOCK_REALTIME,&now);
+	if (l->time_less(&sl->next,&now))
+	    l->time_set(&l->send_,&now);
+	else
+	    l->time_set(&l->send_,&sl->next);
+    }
+    if (sl->prev)
+	sl->prev->link = sl->link;
+    else
+	l->slices_ = sl->link;
+    if (sl->link)
+	sl->link->prev = sl->prev;
+    pthread_mutex_unlock(&l->mutex_);
+    delete sl;
+}
+
+void
+RateLimiter::pipe_done(void *arg)
+{
+    relaypipe *p = (relaypipe *) arg;
+    RateLimiter *l = p->owner;
+
+    pthread_mutex_lock(&l->mutex_);
+    if (p->prev)
+	p->prev->link = p->link;
+    else
+	l->pipes_ = p->link;
+    if (p->link)
+	p->link->prev = p->prev;
+    pthread_mutex_unlock(&l->mutex_);
+    ::close(p->fd[0]);
+    ::close(p->fd[1]);
+    delete p;
+}
+
+int
+RateLimiter::set_send_trace(const char *path)
+{
+    return set_trace(&sendtrace_,path);
+}
+
+int
+RateLimiter::set_recv_trace(const char *path)
+{
+    return set_trace(&recvtrace_,path);
+}
+
+int
+RateLimiter::set_trace(Trace **slot, const char *path)
+{
+    Trace *trace, *old;
+
+    trace = NULL;
+    if (path) {
+	trace = new Trace();
+	if (trace->open(path) < 0) {
+	    delete trace;
+	    return -1;
+	}
+    }
+
+    pthread_mutex_lock(&mutex_);
+    old = *slot;
+    *slot = trace;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+    return 0;
+}
+
+void
+RateLimiter::set_send_delay(int delay, int jitter, int dist)
+{
+    set_delay(&senddelay_,delay,jitter,dist);
+}
+
+void
+RateLimiter::set_recv_delay(int delay, int jitter, int dist)
+{
+    set_delay(&recvdelay_,delay,jitter,dist);
+}
+
+void
+RateLimiter::set_delay(DelayLine **slot, int delay, int jitter, int dist)
+{
+      // a delay line stays once created, so data it holds keeps its order
+    pthread_mutex_lock(&mutex_);
+    if (!*slot)
+	*slot = new DelayLine();
+    (*slot)->set_delay(delay,jitter,dist);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+RateLimiter::set_queue(int policy, size_t bytes)
+{
+    Bottleneck *queue, *old;
+
+    queue = NULL;
+    if (bytes > 0)
+	queue = new Bottleneck(policy,bytes);
+
+    pthread_mutex_lock(&mutex_);
+    old = queue_;
+    queue_ = queue;
+    pthread_mutex_unlock(&mutex_);
+    delete old;
+}
+
+unsigned long
+RateLimiter::get_drops()
+{
+    unsigned long drops;
+
+    pthread_mutex_lock(&mutex_);
+    drops = queue_ ? queue_->drops() : 0;
+    pthread_mutex_unlock(&mutex_);
+    return drops;
+}
+
+size_t
+RateLimiter::send(int s, const void *buf, size_t len, int flags)
+{
+      // send at unlimited rate if no rate configured
+    if (!shaping_send())
+	return ::send(s,buf,len,flags);
+
+    inflight slot(concurrency_,flags,1);
+    if (slot.failed)
+	return -1;
+    return sendchunks(s,buf,len,flags,1,Priority::SOCKET);
+}
+
+size_t
+RateLimiter::send(int s, const void *buf, size_t len, int flags, int cls)
+{
+    if (!shaping_send())
+	return ::send(s,buf,len,flags);
+
+    inflight slot(concurrency_,flags,1);
+    if (slot.failed)
+	return -1;
+    return sendchunks(s,buf,len,flags,1,cls);
+}
+
+size_t
+RateLimiter::sendchunks(int s, const void *buf, size_t len, int flags,
+			int op, int cls)
+{
+    struct timespec t1, t2;
+    char *ptr;
+    size_t total,size,burst;
+    ssize_t result;
+    unsigned int start;
+    int zerocopy, nocopy, error;
+
+      // a datagram goes whole, however big
+    burst = maxburst_;
+    if (len > burst && datagram(s))
+	burst = len;
+
+      // a zero-copy send waits for the kernel to be done with the
+      // buffer, so only a caller that may block makes one
+    nocopy = zerocopy_ && !deferral && !(flags & MSG_DONTWAIT) &&
+	!(fcntl(s,F_GETFL) & O_NONBLOCK);
+
+    ptr = (char *) buf;
+    total = len;
+    zerocopy = 0;
+    while (total > 0) {
+	  // find size to send
+	if (total > burst)
+	    size = burst;
+	else
+	    size = total;
+
+	  // wait for my turn, unless the bottleneck queue drops the chunk;
+	  // the first chunk also pays for the operation
+	if (pace_send(s,size,total == len ? op : 0,cls,flags) < 0)
+	    break;
+
+	  // send the data
+	clock_gettime(CLOCK_REALTIME,&t1);
+	if (senddelay_) {
+	    result = senddelay_->send(s,ptr,size,flags);
+	} else if (nocopy && size >= zcmin_) {
+	    result = zerocopy_->send(s,ptr,size,flags);
+	    zerocopy = 1;
+	} else {
+	    result = sendall(s,ptr,size,flags);
+	}
+	clock_gettime(CLOCK_REALTIME,&t2);
+	if (result > 0)
+	    sent(&t1,&t2);
+
+	  // a socket that is full, or an error, ends the send; what did
+	  // not go is given back, and the caller hears what did
+	if (result < (ssize_t) size) {
+	    if (result < 0)
+		result = 0;
+	    unsent(s,size - result);
+	    total -= result;
+	    break;
+	}
+
+	total -= size;
+	ptr += size;
+
+	  // pick up completions while paced, so few are left at the end
+	if (zerocopy)
+	    zerocopy_->reap(s,0);
+    }
+
+      // the buffer is the caller's again once the kernel is done with
+      // it; the wait is in rounds, so that stop() or cancel() ends it
+    if (zerocopy) {
+	error = errno;
+	__atomic_fetch_add(&waiters_,1,__ATOMIC_SEQ_CST);
+	start = __atomic_load_n(&gen_,__ATOMIC_SEQ_CST);
+	while (zerocopy_->reap(s,reap_round) < 0 && errno == ETIMEDOUT &&
+	       !__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST) &&
+	       !cancelled(s,start))
+	    ;
+	__atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
+	errno = error;
+    }
+    if (total == 0)
+	return len;
+    return total < len ? len - total : -1;
+}
+
+size_t
+RateLimiter::recv(int s, void *buf, size_t len, int flags)
+{
+    struct timespec t1, t2;
+    size_t size;
+    int result;
+
+      // send at unlimited rate if no rate configured
+    if (!shaping_recv())
+        return ::recv(s,buf,len,flags);
+
+      // a receive waits on the peer, so its latency says nothing about
+      // congestion
+    inflight slot(concurrency_,flags,0);
+    if (slot.failed)
+	return -1;
+
+      // find size to receive; a datagram cut short would lose the rest
+    if (len > (size_t) maxburst_ && !datagram(s))
+	size = maxburst_;
+    else
+	size = len;
+
+      // get the data
+    clock_gettime(CLOCK_REALTIME,&t1);
+    if (recvdelay_)
+	result = recvdelay_->recv(s,buf,size,flags);
+    else
+	result = ::recv(s,buf,size,flags);
+    if (result <= 0)
+	return result;
+    clock_gettime(CLOCK_REALTIME,&t2);
+
+    pace_recv(s,result,1,&t1,&t2);
+    return result;
+}
+
+ssize_t
+RateLimiter::sendmsg(int s, const struct msghdr *msg, int flags)
+{
+    struct timespec t1, t2;
+    size_t size, off;
+    ssize_t result;
+    char *buf;
+    int i;
+
+    if (!shaping_send())
+	return ::sendmsg(s,msg,flags);
+
+      // a delay line holds plain data only, which is known before
+      // anything is charged
+    if (senddelay_ && msg->msg_controllen > 0) {
+	errno = EOPNOTSUPP;
+	return -1;
+    }
+
+    inflight slot(concurrency_,flags,1);
+    if (slot.failed)
+	return -1;
+
+      // a message is paced as a whole, since it must go in one call
+    size = iovlen(msg);
+    if (pace_send(s,size,1,Priority::SOCKET,flags) < 0)
+	return -1;
+
+    clock_gettime(CLOCK_REALTIME,&t1);
+    if (senddelay_) {
+	buf = new char[size];
+	for (i = 0, off = 0; i < (int) msg->msg_iovlen; i++) {
+	    memcpy(buf + off,msg->msg_iov[i].iov_base,msg->msg_iov[i].iov_len);
+	    off += msg->msg_iov[i].iov_len;
+	}
+	result = senddelay_->send(s,buf,size,flags);
+	delete[] buf;
+    } else {
+	result = ::sendmsg(s,msg,flags);
+    }
+    if (result < 0) {
+	unsent(s,size);
+	return result;
+    }
+    clock_gettime(CLOCK_REALTIME,&t2);
+    sent(&t1,&t2);
+    if (result < (ssize_t) size)
+	unsent(s,size - result);
+    return result;
+}
+
+int
+RateLimiter::sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen,
+		      int flags)
+{
+    struct timespec t1, t2;
+    unsigned int i, n, total;
+    size_t size, len;
+    ssize_t r;
+    int result;
+
+    if (!shaping_send())
+	return ::sendmmsg(s,msgs,vlen,flags);
+
+      // a delay line holds plain data, one message at a time
+    if (senddelay_) {
+	for (i = 0; i < vlen; i++) {
+	    if ((r = sendmsg(s,&msgs[i].msg_hdr,flags)) < 0)
+		break;
+	    msgs[i].msg_len = r;
+	}
+	return i > 0 ? (int) i : -1;
+    }
+
+    inflight slot(concurrency_,flags,1);
+    if (slot.failed)
+	return -1;
+
+    total = 0;
+    while (total < vlen) {
+	  // gather whole messages into a burst
+	size = 0;
+	for (n = 0; total + n < vlen; n++) {
+	    len = iovlen(&msgs[total + n].msg_hdr);
+	    if (n > 0 && size + len > (size_t) maxburst_)
+		break;
+	    size += len;
+	}
+
+	  // one reservation for the burst, and one operation per message
+	if (pace_send(s,size,n,Priority::SOCKET,flags) < 0)
+	    break;
+
+	clock_gettime(CLOCK_REALTIME,&t1);
+	result = ::sendmmsg(s,msgs + total,n,flags);
+	clock_gettime(CLOCK_REALTIME,&t2);
+	if (result > 0)
+	    sent(&t1,&t2);
+
+	  // messages that did not go are given back
+	if (result < (int) n) {
+	    if (result < 0)
+		result = 0;
+	    for (len = 0, i = total + result; i < total + n; i++)
+		len += iovlen(&msgs[i].msg_hdr);
+	    unsent(s,len);
+	    total += result;
+	    break;
+	}
+	total += n;
+    }
+    return total > 0 ? (int) total : -1;
+}
+
+int
+RateLimiter::recvmmsg(int s, struct mmsghdr *msgs, unsigned int vlen,
+		      int flags, struct timespec *timeout)
+{
+    struct timespec t1, t2;
+    size_t size;
+    ssize_t r;
+    int result, i;
+
+    if (!shaping_recv())
+	return ::recvmmsg(s,msgs,vlen,flags,timeout);
+
+      // a delay line holds plain data, one message at a time
+    if (recvdelay_) {
+	if ((r = recvmsg(s,&msgs[0].msg_hdr,flags)) < 0)
+	    return -1;
+	msgs[0].msg_len = r;
+	return 1;
+    }
+
+    inflight slot(concurrency_,flags,0);
+    if (slot.failed)
+	return -1;
+
+    clock_gettime(CLOCK_REALTIME,&t1);
+    result = ::recvmmsg(s,msgs,vlen,flags,timeout);
+    if (result <= 0)
+	return result;
+    clock_gettime(CLOCK_REALTIME,&t2);
+
+      // the batch is paid for as a whole, one operation per message
+    size = 0;
+    for (i = 0; i < result; i++)
+	size += msgs[i].msg_len;
+    pace_recv(s,size,result,&t1,&t2);
+    return result;
+}
+
+int
+RateLimiter::datagram(int s)
+{
+    socklen_t len;
+    int type;
+
+    len = sizeof(type);
+    return getsockopt(s,SOL_SOCKET,SO_TYPE,&type,&len) == 0 &&
+	type != SOCK_STREAM;
+}
+
+ssize_t
+RateLimiter::recvmsg(int s, struct msghdr *msg, int flags)
+{
+    struct timespec t1, t2;
+    size_t size, off, n;
+    ssize_t result;
+    char *buf;
+    int i;
+
+    if (!shaping_recv())
+	return ::recvmsg(s,msg,flags);
+
+    inflight slot(concurrency_,flags,0);
+    if (slot.failed)
+	return -1;
+
+    clock_gettime(CLOCK_REALTIME,&t1);
+    if (recvdelay_) {
+	  // a delay line holds plain data only, so scatter it by hand
+	size = 0;
+	for (i = 0; i < (int) msg->msg_iovlen; i++)
+	    size += msg->msg_iov[i].iov_len;
+	buf = new char[size];
+	result = recvdelay_->recv(s,buf,size,flags);
+	for (i = 0, off = 0; result > 0 && off < (size_t) result &&
+		 off < size; i++) {
+	    n = msg->msg_iov[i].iov_len;
+	    if (n > result - off)
+		n = result - off;
+	    memcpy(msg->msg_iov[i].iov_base,buf + off,n);
+	    off += n;
+	}
+	delete[] buf;
+	msg->msg_controllen = 0;
+	msg->msg_flags = (result > (ssize_t) size) ? MSG_TRUNC : 0;
+    } else {
+	result = ::recvmsg(s,msg,flags);
+    }
+    if (result <= 0)
+	return result;
+    clock_gettime(CLOCK_REALTIME,&t2);
+
+    pace_recv(s,result,1,&t1,&t2);
+    return result;
+}
+
+ssize_t
+RateLimiter::splice(int in, loff_t *inoff, int out, loff_t *outoff,
+		    size_t len, unsigned int flags)
+{
+    struct timespec t1, t2;
+    struct stat st;
+    int insock, outsock, sending;
+    ssize_t result;
+
+    insock = (fstat(in,&st) == 0 && S_ISSOCK(st.st_mode));
+    outsock = (fstat(out,&st) == 0 && S_ISSOCK(st.st_mode));
+    sending = outsock && shaping_send();
+    if (!sending && (!insock || !shaping_recv()))
+	return ::splice(in,inoff,out,outoff,len,flags);
+
+    inflight slot(concurrency_,(flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0,
+		  sending);
+    if (slot.failed)
+	return -1;
+
+      // move at most one burst, paced like send() when writing to a
+      // socket and like recv() when reading from one
+    if (sending) {
+	if (len > (size_t) maxburst_)
+	    len = maxburst_;
+	if (pace_send(out,len,1,Priority::SOCKET,
+		      (flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0) < 0)
+	    return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME,&t1);
+    result = ::splice(in,inoff,out,outoff,len,flags);
+    if (result <= 0) {
+	if (sending)
+	    unsent(out,len);
+	return result;
+    }
+    clock_gettime(CLOCK_REALTIME,&t2);
+    if (sending) {
+	sent(&t1,&t2);
+	if (result < (ssize_t) len)
+	    unsent(out,len - result);
+    } else
+	pace_recv(in,result,1,&t1,&t2);
+    return result;
+}
+
+ssize_t
+RateLimiter::relay(int in, int out, size_t count, int flags)
+{
+    struct timespec t1, t2;
+    relaypipe *p;
+    size_t total, size;
+    ssize_t n, result;
+    unsigned int sflags;
+    int shaping;
+    char *buf;
+
+    shaping = shaping_send();
+    inflight slot(shaping ? concurrency_ : NULL,flags,1);
+    if (slot.failed)
+	return -1;
+
+      // a delay line keeps a copy of the data, so it cannot be spliced
+      // and is read into a buffer instead
+    p = NULL;
+    buf = NULL;
+    if (senddelay_)
+	buf = new char[(count < (size_t) maxburst_) ? count : maxburst_];
+    else if (!(p = relay_pipe()))
+	return -1;
+
+    sflags = SPLICE_F_MOVE | ((flags & MSG_DONTWAIT) ? SPLICE_F_NONBLOCK : 0);
+    total = 0;
+    result = 0;
+    while (total < count) {
+	size = count - total;
+	if (size > (size_t) maxburst_)
+	    size = maxburst_;
+	if (p && size > p->size)
+	    size = p->size;
+
+	  // pay for the chunk before taking it off the incoming socket,
+	  // so that a chunk turned away stays where it was
+	if (shaping && pace_send(out,size,total == 0,Priority::SOCKET,
+				 flags) < 0) {
+	    result = -1;
+	    break;
+	}
+
+	  // take what is ready, up to the chunk, and give back the rest
+	do {
+	    if (buf)
+		n = ::recv(in,buf,size,flags);
+	    else
+		n = ::splice(in,NULL,p->fd[1],NULL,size,sflags);
+	} while (n < 0 && errno == EINTR);
+	if (shaping && n < (ssize_t) size)
+	    unsent(out,size - (n > 0 ? n : 0));
+	if (n <= 0) {
+	    result = n;
+	    break;
+	}
+
+	  // what was taken cannot go back, so all of it goes out, or
+	  // into the delay line
+	clock_gettime(CLOCK_REALTIME,&t1);
+	if (buf)
+	    result = senddelay_->send(out,buf,n,flags);
+	else
+	    result = relay_drain(p,out,n);
+	clock_gettime(CLOCK_REALTIME,&t2);
+	if (shaping && result > 0)
+	    sent(&t1,&t2);
+	if (result < n) {
+	    if (shaping)
+		unsent(out,n - (result > 0 ? result : 0));
+	    if (result > 0)
+		total += result;
+	    result = -1;
+	    break;
+	}
+	total += n;
+	if (n < (ssize_t) size)
+	    break;
+    }
+    delete[] buf;
+    return total > 0 ? (ssize_t) total : result;
+}
+
+RateLimiter::relaypipe *
+RateLimiter::relay_pipe()
+{
+    relaypipe *p;
+    int size;
+
+    if (!piping_) {
+	pthread_mutex_lock(&mutex_);
+	if (!piping_ && pthread_key_create(&pipekey_,pipe_done) == 0)
+	    piping_ = 1;
+	pthread_mutex_unlock(&mutex_);
+	if (!piping_) {
+	    errno = EAGAIN;
+	    return NULL;
+	}
+    }
+    p = (relaypipe *) pthread_getspecific(pipekey_);
+    if (p)
+	return p;
+
+      // a pipe that holds a whole burst, if the system allows it
+    p = new relaypipe;
+    if (pipe2(p->fd,O_CLOEXEC) < 0) {
+	delete p;
+	return NULL;
+    }
+    fcntl(p->fd[1],F_SETPIPE_SZ,maxburst_);
+    size = fcntl(p->fd[1],F_GETPIPE_SZ);
+    p->size = (size > 0) ? size : 65536;
+    p->owner = this;
+    p->prev = NULL;
+    pthread_mutex_lock(&mutex_);
+    p->link = pipes_;
+    if (pipes_)
+	pipes_->prev = p;
+    pipes_ = p;
+    pthread_mutex_unlock(&mutex_);
+    pthread_setspecific(pipekey_,p);
+    return p;
+}
+
+ssize_t
+RateLimiter::relay_drain(relaypipe *p, int out, size_t len)
+{
+    struct pollfd pfd;
+    size_t left;
+    ssize_t n;
+    int error;
+
+    left = len;
+    while (left > 0) {
+	n = ::splice(p->fd[0],NULL,out,NULL,left,SPLICE_F_MOVE);
+	if (n > 0) {
+	    left -= n;
+	    continue;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && errno == EAGAIN) {
+	    pfd.fd = out;
+	    pfd.events = POLLOUT;
+	    poll(&pfd,1,-1);
+	    continue;
+	}
+
+	  // the rest is lost, and so is the pipe that holds it
+	error = errno;
+	pthread_setspecific(pipekey_,NULL);
+	pipe_done(p);
+	errno = error;
+	break;
+    }
+    return len - left;
+}
+
+ssize_t
+RateLimiter::sendfile(int sock, int fd, off_t* offset, size_t count)
+{
+    ssize_t len, rnum, snum;
+    char buf[1025];
+
+    if (!shaping_send())
+	return ::sendfile(sock,fd,offset,count);
+
+    inflight slot(concurrency_,0,1);
+    if (slot.failed)
+	return -1;
+
+    len = 0;
+    while (len < (ssize_t) count) {
+	  // read from file, at the offset if one is given
+	if (offset)
+	    rnum = ::pread(fd,buf,1024,*offset);
+	else
+	    rnum = ::read(fd,buf,1024);
+	if (rnum < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    } else {
+		return rnum;
+	    }
+	} else if (rnum == 0) {
+	      // file closed before we got the desired size
+	    return len;
+	}
+	if (rnum > (ssize_t) (count - len))
+	    rnum = count - len;
+	snum = sendchunks(sock,buf,rnum,0,len == 0,Priority::SOCKET);
+
+	  // a short send leaves the rest of the file to be sent later
+	if (snum < rnum) {
+	    if (snum < 0)
+		snum = 0;
+	    if (offset)
+		*offset += snum;
+	    else
+		lseek(fd,snum - rnum,SEEK_CUR);
+	    len += snum;
+	    return len ? len : -1;
+	}
+	len += rnum;
+	if (offset)
+	    *offset += rnum;
+    }
+    return count;
+}
+
+ssize_t
+RateLimiter::read(int fd, void *buf, size_t count)
+{
+    return fileio(fd,(char *) buf,count,NULL,0);
+}
+
+ssize_t
+RateLimiter::write(int fd, const void *buf, size_t count)
+{
+    return fileio(fd,(char *) buf,count,NULL,1);
+}
+
+ssize_t
+RateLimiter::pread(int fd, void *buf, size_t count, off_t offset)
+{
+    return fileio(fd,(char *) buf,count,&offset,0);
+}
+
+ssize_t
+RateLimiter::pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    return fileio(fd,(char *) buf,count,&offset,1);
+}
+
+ssize_t
+RateLimiter::fileio(int fd, char *buf, size_t len, off_t *offset, int out)
+{
+    struct timespec t1, t2;
+    struct stat st;
+    size_t total, size, chunk;
+    ssize_t result;
+
+    if (out ? !shaping_send() : !shaping_recv()) {
+	if (offset)
+	    return out ? ::pwrite(fd,buf,len,*offset) :
+		::pread(fd,buf,len,*offset);
+	return out ? ::write(fd,buf,len) : ::read(fd,buf,len);
+    }
+
+      // a disk does not wait on a peer, so the latency of a read says
+      // as much about congestion as that of a write
+    inflight slot(concurrency_,0,1);
+    if (slot.failed)
+	return -1;
+
+      // move whole blocks, as a direct transfer must
+    chunk = (fstat(fd,&st) == 0 && st.st_blksize > 0) ? st.st_blksize : 512;
+    if ((size_t) maxburst_ >= chunk)
+	chunk = maxburst_ - maxburst_ % chunk;
+
+    total = 0;
+    result = 0;
+    while (total < len) {
+	size = len - total;
+	if (size > chunk)
+	    size = chunk;
+
+	  // a write waits for its turn first, like a send
+	if (out && pace_send(fd,size,1,Priority::SOCKET,0) < 0) {
+	    result = -1;
+	    break;
+	}
+
+	clock_gettime(CLOCK_REALTIME,&t1);
+	do {
+	    if (offset)
+		result = out ? ::pwrite(fd,buf + total,size,*offset + total) :
+		    ::pread(fd,buf + total,size,*offset + total);
+	    else
+		result = out ? ::write(fd,buf + total,size) :
+		    ::read(fd,buf + total,size);
+	} while (result < 0 && errno == EINTR);
+	clock_gettime(CLOCK_REALTIME,&t2);
+
+	  // what a write did not move is given back; a read pays for
+	  // what it got, and stops if its wait is cancelled
+	if (out) {
+	    if (result > 0)
+		sent(&t1,&t2);
+	    if (result < (ssize_t) size)
+		unsent(fd,size - (result > 0 ? result : 0));
+	} else if (result > 0 && pace_recv(fd,result,1,&t1,&t2) < 0) {
+	    total += result;
+	    break;
+	}
+	if (result <= 0)
+	    break;
+	total += result;
+
+	  // the end of the file, or a full device
+	if (result < (ssize_t) size)
+	    break;
+    }
+    return total > 0 ? (ssize_t) total : result;
 }
 
-RateLimiter::RateLimiter(int r, int maxburst)
+int
+RateLimiter::close(int s)
 {
-    rate_ = r*1000;
-    maxburst_ = maxburst;
-    clock_gettime(CLOCK_REALTIME,&send_);
-    pthread_mutex_init(&mutex_, NULL);
-}
+    map<int,cap>::iterator i;
 
-RateLimiter::~RateLimiter()
-{
-    pthread_mutex_destroy(&mutex_);
+    if (fair_ || priority_ || !caps_.empty()) {
+	pthread_mutex_lock(&mutex_);
+	if (fair_)
+	    fair_->forget(s);
+	if (priority_)
+	    priority_->forget(s);
+	i = caps_.find(s);
+	if (i != caps_.end()) {
+	    if (!i->second.kernel)
+		capped_--;
+	    caps_.erase(i);
+	}
+	pthread_mutex_unlock(&mutex_);
+    }
+    if (zerocopy_)
+	zerocopy_->forget(s);
+    pthread_mutex_lock(&waitlock_);
+    cancels_.erase(s);
+    pthread_mutex_unlock(&waitlock_);
+    if (recvdelay_)
+	recvdelay_->discard(s);
+    if (senddelay_)
+	return senddelay_->close(s);
+    return ::close(s);
 }
 
-size_t
-RateLimiter::send(int s, const void *buf, size_t len, int flags)
+int
+RateLimiter::pace_send(int s, size_t size, int op, int cls, int flags)
 {
     struct timespec now, mysend;
-    struct timespec t1, t2, diff;
+    int64_t opwait, optail, wait, bound, leasewait;
     double duration;
-    char *ptr;
-    size_t total,size, result;
+    int error, result;
 
-      // send at unlimited rate if no rate configured
-    if (rate_ == 0)
-        return ::send(s,buf,len,flags);
+    start();
 
-    ptr = (char *) buf;
-    total = len;
-    while (total > 0) {
-	  // find size to send
-	if (total > maxburst_)
-	    size = maxburst_;
+      // a caller that will not wait, or will only wait so long, is
+      // turned away before anything is charged
+    bound = -1;
+    error = 0;
+    wait = __atomic_load_n(&maxdelay_,__ATOMIC_RELAXED);
+    if (flags & MSG_DONTWAIT) {
+	bound = 0;
+	error = EAGAIN;
+    } else if (wait > 0) {
+	bound = wait;
+	error = ETIMEDOUT;
+    }
+    if (cls == Priority::BYPASS)
+	bound = -1;
+
+      // draw from the fleet-wide lease first; a call waiting for its
+      // renewal counts as a waiter, so that stop() can turn it away
+    leasewait = 0;
+    if (lease_) {
+	__atomic_fetch_add(&waiters_,1,__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST)) {
+	    errno = ECANCELED;
+	    leasewait = -1;
+	} else if (deferral && bound < 0)
+	    leasewait = lease_->take(size,0);
 	else
-	    size = total;
+	    leasewait = lease_->take(size,bound);
+	__atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
+	if (leasewait < 0) {
+	    if (errno != ECANCELED)
+		errno = error ? error : EAGAIN;
+	    return -1;
+	}
+    }
 
-	  // figure ideal duration of sending
-	duration = (double) (size * 8) / rate_;
+      // charge the operation, if this chunk starts one; the data waits
+      // for whichever of the budgets is later
+    opwait = 0;
+    optail = 0;
+    if (op && (opwait = take_op(&sendop_,op,bound,&optail)) < 0)
+	return refuse(-1,size,op,optail,error);
+    if (leasewait > opwait)
+	opwait = leasewait;
 
-	  // get current time
-	clock_gettime(CLOCK_REALTIME,&now);
+      // so does the socket's own cap, when the limiter paces it
+    if (capped_) {
+	if ((wait = take_cap(s,size,bound)) < 0)
+	    return refuse(-1,size,op,optail,error);
+	if (wait > opwait)
+	    opwait = wait;
+    }
 
-	  // initialize my starting time
-	mysend.tv_sec = 0;
-	mysend.tv_nsec = 0;
+      // the cell rate algorithm needs no lock
+    if (gcra_send()) {
+	if (sendgcra_->reserve(size,GcraEngine::now(),bound,&wait) < 0)
+	    return refuse(s,size,op,optail,error);
+	result = time_wait(s,wait > opwait ? wait : opwait,wait > opwait);
+	goto paused;
+    }
 
-	  // begin critical section
-	pthread_mutex_lock(&mutex_);
+      // spend this thread's slice of the timeline
+    if (slicing()) {
+	if (pace_slice(size,bound,&mysend) < 0)
+	    return refuse(s,size,op,optail,error);
+	result = time_pause(s,&mysend,opwait,1);
+	goto paused;
+    }
 
-	  // handle bookkeeping to get accurate rate
-	if (duration >= sendextra_) {
-	    duration -= sendextra_;
-	    sendextra_ = 0;
-	} else {
-	    sendextra_ -= duration;
-	    duration = 0;
+      // get current time
+    clock_gettime(CLOCK_REALTIME,&now);
+
+      // a shared timeline needs no lock
+    if (shared_) {
+	if (shared_->reserve(SharedTimeline::SEND,size,&now,&mysend,
+			     bound) < 0)
+	    return refuse(s,size,op,optail,error);
+	result = time_pause(s,&mysend,opwait,1);
+	goto paused;
+    }
+
+      // so does a sharded one
+    if (sharded_send()) {
+	if (shards_->reserve(ShardedBudget::SEND,size,&now,&mysend,
+			     bound) < 0)
+	    return refuse(s,size,op,optail,error);
+	result = time_pause(s,&mysend,opwait,1);
+	goto paused;
+    }
+
+      // initialize my starting time
+    mysend.tv_sec = 0;
+    mysend.tv_nsec = 0;
+
+      // begin critical section
+    pthread_mutex_lock(&mutex_);
+    if (priority_ && cls == Priority::SOCKET)
+	cls = priority_->get_class(s);
+
+      // turn the chunk away if it would wait too long for its time
+    if (bound >= 0 &&
+	(priority_ ? priority_->delay(cls,&now) :
+	 time_less(&now,&send_) ? time_diff2(&send_,&now) : 0) >
+	(double) bound / 1000000000) {
+	pthread_mutex_unlock(&mutex_);
+	return refuse(s,size,op,optail,error);
+    }
+
+      // wait for my flow's turn, when flows share the link fairly,
+      // unless the wait is cancelled
+    if (fairing() && cls != Priority::BYPASS && !deferral) {
+	__atomic_fetch_add(&waiters_,1,__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST) ||
+	    fair_->wait(&mutex_,s,size,&send_) < 0) {
+	    __atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
+	    pthread_mutex_unlock(&mutex_);
+	    return refuse(s,size,op,optail,ECANCELED);
 	}
+	__atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
+	clock_gettime(CLOCK_REALTIME,&now);
+    }
+
+      // the bottleneck queue may drop the chunk, as a router would
+    if (queue_ && cls != Priority::BYPASS &&
+	!queue_->admit(&now,time_less(&now,&send_) ?
+		       time_diff2(&send_,&now) : 0,size)) {
+	pthread_mutex_unlock(&mutex_);
+	return refuse(s,size,op,optail,ENOBUFS);
+    }
+
+      // figure ideal duration of sending
+    duration = transmit_time(sendtrace_,&send_,&now,size);
+
+      // handle bookkeeping to get accurate rate
+    if (duration >= sendextra_) {
+	duration -= sendextra_;
+	sendextra_ = 0;
+    } else {
+	sendextra_ -= duration;
+	duration = 0;
+    }
 
-	  // get my sending time and set next sending time
+      // get my sending time and set next sending time; with traffic
+      // classes, each class has a timeline of its own
+    if (priority_) {
+	time_add(&mysend,priority_->schedule(cls,&now,duration));
+	priority_->horizon(&send_);
+    } else {
 	if (time_less(&send_,&now))
 	    time_set(&send_,&now);
 	else
 	    time_diff(&send_,&now,&mysend);
 	time_add(&send_,duration);
+	time_add(&mysend,duration);
+    }
+    if (queue_)
+	queue_->enqueue(&send_,size);
+    scheduled.limiter = this;
+    scheduled.cls = cls;
+    scheduled.finish = send_;
+
+      // end critical section
+    pthread_mutex_unlock(&mutex_);
+
+      // sleep until it is my time to send
+    result = time_pause(s,&mysend,opwait,!sendtrace_);
+
+      // a wait cut short sends nothing, so what it was charged is
+      // given back
+ paused:
+    if (result < 0) {
+	error = errno;
+	unsent(s,size);
+	errno = error;
+    }
+    return result;
+}
+
+int
+RateLimiter::pace_slice(size_t size, int64_t bound, struct timespec *wait)
+{
+    struct timespec now;
+    double duration, need, len, extra;
+    slice *sl;
 
-	  // end critical section
+    sl = (slice *) pthread_getspecific(slicekey_);
+    if (!sl) {
+	sl = new slice;
+	sl->owner = this;
+	sl->next.tv_sec = 0;
+	sl->next.tv_nsec = 0;
+	sl->left = 0;
+	sl->extra = 0;
+	sl->prev = NULL;
+	pthread_mutex_lock(&mutex_);
+	sl->link = slices_;
+	if (slices_)
+	    slices_->prev = sl;
+	slices_ = sl;
 	pthread_mutex_unlock(&mutex_);
+	pthread_setspecific(slicekey_,sl);
+    }
 
-	  // sleep until it is my time to send
-	time_add(&mysend,duration);
-	nanosleep(&mysend,NULL);
+      // get current time
+    clock_gettime(CLOCK_REALTIME,&now);
 
-	  // send the data
-	clock_gettime(CLOCK_REALTIME,&t1);
-	result = sendall(s,ptr,size,flags);
-	if (result < 0)
-	    return result;
-	clock_gettime(CLOCK_REALTIME,&t2);
+      // figure ideal duration of sending, less time already spent
+    duration = transmit_time(NULL,&send_,&now,size);
+    extra = sl->extra;
+    if (duration >= sl->extra) {
+	duration -= sl->extra;
+	sl->extra = 0;
+    } else {
+	sl->extra -= duration;
+	duration = 0;
+    }
 
-	  // adjust bookkeeping
+      // the part of the slice that passed while idle is lost
+    if (time_less(&sl->next,&now)) {
+	sl->left -= time_diff2(&now,&sl->next);
+	if (sl->left < 0)
+	    sl->left = 0;
+	time_set(&sl->next,&now);
+    }
+
+    if (duration <= sl->left) {
+	time_add(&sl->next,duration);
+	sl->left -= duration;
+    } else {
+	  // lease a new slice, big enough for the rest of this chunk
+	need = duration - sl->left;
+	len = (need > slice_) ? need : slice_;
 	pthread_mutex_lock(&mutex_);
-	sendextra_ += time_diff2(&t2,&t1);
+
+	  // a chunk that cannot start in what is left of my slice waits
+	  // for the new one, unless that is too long
+	if (bound >= 0 && sl->left == 0 && time_less(&now,&send_) &&
+	    time_diff2(&send_,&now) > (double) bound / 1000000000) {
+	    pthread_mutex_unlock(&mutex_);
+	    sl->extra = extra;
+	    return -1;
+	}
+	if (time_less(&send_,&now))
+	    time_set(&send_,&now);
+	time_set(&sl->next,&send_);
+	time_add(&send_,len);
 	pthread_mutex_unlock(&mutex_);
+	time_add(&sl->next,need);
+	sl->left = len - need;
+    }
 
-	total -= size;
-	ptr += size;
+      // wait until my part of the slice ends
+    wait->tv_sec = 0;
+    wait->tv_nsec = 0;
+    if (time_less(&now,&sl->next))
+	time_diff(&sl->next,&now,wait);
+    return 0;
+}
+
+void
+RateLimiter::sent(struct timespec *t1, struct timespec *t2)
+{
+    slice *sl;
+
+    count_busy(t1,t2);
+
+      // time spent sending counts towards the next chunk; the cell rate
+      // algorithm already allows for a burst
+    if (gcra_send())
+	return;
+    if (slicing() && (sl = (slice *) pthread_getspecific(slicekey_))) {
+	sl->extra += time_diff2(t2,t1);
+	return;
     }
-    return len;
+    if (shared_) {
+	shared_->credit(SharedTimeline::SEND,time_diff2(t2,t1));
+	return;
+    }
+    if (sharded_send()) {
+	shards_->credit(ShardedBudget::SEND,time_diff2(t2,t1));
+	return;
+    }
+    pthread_mutex_lock(&mutex_);
+    sendextra_ += time_diff2(t2,t1);
+    pthread_mutex_unlock(&mutex_);
 }
 
-size_t
-RateLimiter::recv(int s, void *buf, size_t len, int flags)
+void
+RateLimiter::unsent(int s, size_t size)
 {
-    struct timespec now, myrecv;
-    struct timespec t1, t2, diff;
     double duration;
-    char *ptr;
-    size_t total,size;
-    int result;
+    slice *sl;
 
-      // send at unlimited rate if no rate configured
-    if (rate_ == 0)
-        return ::recv(s,buf,len,flags);
+      // bytes that were paced but not sent are given back, as time
+      // credited towards the next chunk; time from a trace is spent
+    if (lease_)
+	lease_->give(size);
+    if (capped_)
+	give_cap(s,size);
+    if (gcra_send()) {
+	sendgcra_->give(size);
+	return;
+    }
+    if (rate_ == 0 || sendtrace_)
+	return;
+    if (sharded_send()) {
+	shards_->give(ShardedBudget::SEND,size);
+	return;
+    }
+    duration = (double) (size * 8) / rate_;
+    if (slicing() && (sl = (slice *) pthread_getspecific(slicekey_))) {
+	sl->extra += duration;
+	return;
+    }
+    if (shared_) {
+	shared_->credit(SharedTimeline::SEND,duration);
+	return;
+    }
 
-      // find size to receive
-    if (len > maxburst_)
-	size = maxburst_;
-    else
-	size = len;
+      // the bytes leave the bottleneck queue, and go back to the
+      // class that paid for them
+    pthread_mutex_lock(&mutex_);
+    if (scheduled.limiter == this) {
+	if (queue_)
+	    queue_->dequeue(&scheduled.finish,size);
+	if (priority_ && scheduled.cls != Priority::BYPASS) {
+	    priority_->credit(scheduled.cls,duration);
+	    pthread_mutex_unlock(&mutex_);
+	    return;
+	}
+    }
+    sendextra_ += duration;
+    pthread_mutex_unlock(&mutex_);
+}
 
-      // get the data
-    clock_gettime(CLOCK_REALTIME,&t1);
-    result = ::recv(s,buf,size,flags);
-    if (result <= 0)
-	return result;
-    clock_gettime(CLOCK_REALTIME,&t2);
+int
+RateLimiter::get_wait(int s)
+{
+    int64_t wait;
 
-      // figure ideal duration of receiving
-    duration = (double) (result * 8) / rate_;
+    if (!shaping_send())
+	return 0;
+    wait = delay(s,1);
+    return wait > 0 ? (int) ((wait + 999) / 1000) : 0;
+}
+
+int64_t
+RateLimiter::delay(int s, int out)
+{
+    map<int,cap>::iterator i;
+    struct timespec now, *next;
+    int64_t t, wait, op;
+    int cls;
+
+      // a query does not start the limiter, so it holds the lock to
+      // keep the budgets from being replaced under it
+    pthread_mutex_lock(&mutex_);
+    clock_gettime(CLOCK_REALTIME,&now);
+    t = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+      // the later of the operation's time and the bytes' time
+    op = 0;
+    if (__atomic_load_n(&opstep_,__ATOMIC_RELAXED) > 0)
+	op = __atomic_load_n(out ? &sendop_ : &recvop_,__ATOMIC_RELAXED) - t;
+    if (out ? gcra_send() : gcra_recv()) {
+	wait = (out ? sendgcra_ : recvgcra_)->delay(t);
+    } else if (shared_) {
+	wait = shared_->delay(out ? SharedTimeline::SEND :
+			      SharedTimeline::RECV,&now);
+    } else if (out ? sharded_send() : sharded_recv()) {
+	wait = shards_->delay(out ? ShardedBudget::SEND :
+			      ShardedBudget::RECV,&now);
+    } else {
+	next = out ? &send_ : &recv_;
+	if (out && priority_) {
+	    cls = priority_->get_class(s);
+	    wait = (int64_t) (priority_->delay(cls,&now) * 1000000000);
+	} else {
+	    wait = time_less(&now,next) ?
+		(int64_t) (time_diff2(next,&now) * 1000000000) : 0;
+	}
+    }
+    if (op > wait)
+	wait = op;
+
+      // and the fleet-wide lease, for a burst
+    if (out && lease_ && (op = lease_->delay(maxburst_)) > wait)
+	wait = op;
+
+      // and the socket's own cap
+    if (out && capped_) {
+	i = caps_.find(s);
+	if (i != caps_.end() && !i->second.kernel && i->second.next - t > wait)
+	    wait = i->second.next - t;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return wait;
+}
+
+ssize_t
+RateLimiter::send_now(int s, const void *buf, size_t len, int flags,
+		      struct timespec *until)
+{
+    struct timespec now;
+    int64_t end, wait;
+    ssize_t result;
+
+      // one burst, whose wait is noted rather than slept
+    if (len > (size_t) maxburst_ && !datagram(s))
+	len = maxburst_;
+    end = 0;
+    deferral = &end;
+    result = (ssize_t) send(s,buf,len,flags | MSG_DONTWAIT);
+    deferral = NULL;
+
+      // a send turned away hears when its turn comes
+    if (result < 0 && errno == EAGAIN && shaping_send() &&
+	(wait = delay(s,1)) > 0) {
+	clock_gettime(CLOCK_REALTIME,&now);
+	end = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec + wait;
+    }
+    to_time(until,end);
+    return result;
+}
+
+ssize_t
+RateLimiter::recv_now(int s, void *buf, size_t len, int flags,
+		      struct timespec *until)
+{
+    struct timespec now;
+    int64_t end, wait;
+    ssize_t result;
+
+      // a receive whose turn has not come is turned away before it
+      // takes any data
+    if (shaping_recv() && (wait = delay(s,0)) > 0) {
+	clock_gettime(CLOCK_REALTIME,&now);
+	to_time(until,(int64_t) now.tv_sec * 1000000000 + now.tv_nsec +
+		wait);
+	errno = EAGAIN;
+	return -1;
+    }
+    end = 0;
+    deferral = &end;
+    result = (ssize_t) recv(s,buf,len,flags | MSG_DONTWAIT);
+    deferral = NULL;
+    to_time(until,end);
+    return result;
+}
+
+int
+RateLimiter::pace_recv(int s, size_t size, int ops, struct timespec *t1,
+		       struct timespec *t2)
+{
+    struct timespec now, myrecv;
+    int64_t opwait, optail, wait;
+    double duration;
+
+    start();
+    count_busy(t1,t2);
+
+      // each call is one operation, or each message of a batch
+    opwait = take_op(&recvop_,ops,-1,&optail);
 
       // get current time
     clock_gettime(CLOCK_REALTIME,&now);
 
+      // a shared timeline needs no lock
+    if (shared_) {
+	if (!recvdelay_)
+	    shared_->credit(SharedTimeline::RECV,time_diff2(t2,t1));
+	shared_->reserve(SharedTimeline::RECV,size,&now,&myrecv);
+	return time_pause(s,&myrecv,opwait,1);
+    }
+    if (gcra_recv()) {
+	wait = recvgcra_->reserve(size,GcraEngine::now());
+	return time_wait(s,wait > opwait ? wait : opwait,wait > opwait);
+    }
+    if (sharded_recv()) {
+	if (!recvdelay_)
+	    shards_->credit(ShardedBudget::RECV,time_diff2(t2,t1));
+	shards_->reserve(ShardedBudget::RECV,size,&now,&myrecv);
+	return time_pause(s,&myrecv,opwait,1);
+    }
+
       // initialize my starting time
     myrecv.tv_sec = 0;
     myrecv.tv_nsec = 0;
 
       // begin critical section
     pthread_mutex_lock(&mutex_);
+
+      // figure ideal duration of receiving
+    duration = transmit_time(recvtrace_,&recv_,&now,size);
     
-      // handle bookkeeping to get accurate rate
-    recvextra_ += time_diff2(&t2,&t1);
+      // handle bookkeeping to get accurate rate; time spent waiting
+      // in a delay line is latency, not transfer time
+    if (!recvdelay_)
+	recvextra_ += time_diff2(t2,t1);
     if (duration >= recvextra_) {
 	duration -= recvextra_;
 	recvextra_ = 0;
@@ -184,78 +2411,56 @@ RateLimiter::recv(int s, void *buf, size_t len, int flags)
 
       // sleep until it is my time to receive
     time_add(&myrecv,duration);
-    nanosleep(&myrecv,NULL);
-
-    return result;
+    return time_pause(s,&myrecv,opwait,!recvtrace_);
 }
 
-ssize_t
-RateLimiter::sendfile(int sock, int fd, off_t* offset, size_t count)
+double
+RateLimiter::transmit_time(Trace *trace, struct timespec *next,
+			   struct timespec *now, size_t size)
 {
-    size_t len, rnum, snum;
-    char buf[1025];
-
-    if (rate_ == 0)
-        return ::sendfile(sock,fd,offset,count);
-    
-    len = 0;
-    while (len < count) {
-          // read from file
-        rnum = read(fd,buf,1024);
-        if (rnum < 0) {
-            if (errno == EINTR) {
-                continue;
-            } else {
-		return rnum;
-            }
-	} else if (rnum == 0) {
-	      // file closed before we got the desired size
-	    return len;
-	}
-        if (rnum > (count - len))
-            rnum = count - len;
-        snum = send(sock,buf,rnum,0);
-        if (snum < 0)
-            return snum;
-        len += rnum;
+    if (!trace) {
+	if (rate_ == 0)
+	    return 0;
+	return (double) (size * 8) / rate_;
     }
-    return count;
+
+      // a trace depends on when the link is free to start sending
+    if (time_less(next,now))
+	return trace->advance(now,size);
+    return trace->advance(next,size);
 }
 
-size_t
+ssize_t
 RateLimiter::sendall(int s, char *buf, size_t len, int flags)
 {
     char *ptr;
     size_t nleft;
-    int error = 0;
-    int nwritten;
+    ssize_t nwritten;
 
+      // retry only an interrupted send; a socket that would block has
+      // taken all it can for now, so return what went rather than spin
     ptr = buf;
     nleft = len;
     while (nleft) {
 	if ((nwritten = ::send(s, ptr, nleft, flags)) < 0) {
-	    if (errno == EINTR) {
-		nwritten = 0;
-	    } else {
-                return error;
-	    }
+	    if (errno == EINTR)
+		continue;
+	    if (nleft == len)
+		return -1;
+	    break;
 	} else if (nwritten == 0) {
 	    break;
 	}
 	nleft -= nwritten;
 	ptr += nwritten;
     }
-    return len;
+    return len - nleft;
 }
 
 int
 RateLimiter::time_less(struct timespec *t1, struct timespec *t2)
 {
-    if (t1->tv_sec < t2->tv_sec ||
-	(t1->tv_sec == t2->tv_sec && t1->tv_nsec < t2->tv_nsec))
-	return 1;
-    else
-	return 0;
+    return timespec_before(t1,t2);
 }
 
 void
@@ -268,13 +2473,7 @@ RateLimiter::time_set(struct timespec *t1, struct timespec *t2)
 void
 RateLimiter::time_add(struct timespec *t1, double duration)
 {
-    int nmax = 1000000000;
-    t1->tv_sec += (int) trunc(duration);
-    t1->tv_nsec += (int) trunc((duration - trunc(duration))*nmax);
-    if (t1->tv_nsec >= nmax) {
-	t1->tv_sec += (t1->tv_nsec / nmax);
-	t1->tv_nsec = t1->tv_nsec % nmax;
-    }
+    timespec_add(t1,duration);
 }
 
 void
@@ -293,17 +2492,132 @@ RateLimiter::time_diff(struct timespec *t1, struct timespec *t2,
 double
 RateLimiter::time_diff2(struct timespec *t1, struct timespec *t2)
 {
-    int nmax = 1000000000;
-    long sec;
-    long nsec;
-    double result;
-    
-    sec = t1->tv_sec - t2->tv_sec;
-    nsec = t1->tv_nsec - t2->tv_nsec;
-    if (nsec < 0) {
-	sec -= 1;
-	nsec = nmax + nsec;
+    return timespec_elapsed(t1,t2);
+}
+
+int
+RateLimiter::time_wait(int s, int64_t nsec, int retime)
+{
+    struct timespec now, deadline;
+    unsigned int start, gen;
+    double left;
+    int rate, result;
+
+    if (nsec <= 0)
+	return 0;
+
+      // a call that must not sleep only notes when its wait would end
+    if (deferral) {
+	if (__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST)) {
+	    errno = ECANCELED;
+	    return -1;
+	}
+	clock_gettime(CLOCK_REALTIME,&now);
+	nsec += (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	if (nsec > *deferral)
+	    *deferral = nsec;
+	return 0;
+    }
+
+      // say that I am waiting before looking at what would wake me
+    __atomic_fetch_add(&waiters_,1,__ATOMIC_SEQ_CST);
+    start = __atomic_load_n(&gen_,__ATOMIC_SEQ_CST);
+    gen = start;
+    rate = rate_;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    time_add(&deadline,(double) nsec / 1000000000);
+
+      // sleep on the generation until the deadline; a new generation
+      // means the limiter stopped, a socket was cancelled, or the rate
+      // changed
+    result = 0;
+    while (1) {
+	if (__atomic_load_n(&stopped_,__ATOMIC_SEQ_CST) ||
+	    (gen != start && cancelled(s,start))) {
+	    errno = ECANCELED;
+	    result = -1;
+	    break;
+	}
+	clock_gettime(CLOCK_REALTIME,&now);
+	if (retime && rate > 0 && rate_ != rate) {
+	    left = 0;
+	    if (rate_ > 0 && time_less(&now,&deadline))
+		left = time_diff2(&deadline,&now) * rate / rate_;
+	    time_set(&deadline,&now);
+	    time_add(&deadline,left);
+	    rate = rate_;
+	}
+	if (!time_less(&now,&deadline))
+	    break;
+	if (__atomic_load_n(&scheduling_,__ATOMIC_SEQ_CST))
+	    scheduler_->sleep((int64_t) deadline.tv_sec * 1000000000 +
+			      deadline.tv_nsec,&gen_,gen);
+	else
+	    syscall(SYS_futex,&gen_,
+		    FUTEX_WAIT_BITSET_PRIVATE|FUTEX_CLOCK_REALTIME,gen,
+		    &deadline,NULL,FUTEX_BITSET_MATCH_ANY);
+	gen = __atomic_load_n(&gen_,__ATOMIC_SEQ_CST);
     }
-    result = sec + (double)nsec/nmax;
+    __atomic_fetch_sub(&waiters_,1,__ATOMIC_SEQ_CST);
     return result;
 }
+
+int
+RateLimiter::time_pause(int s, struct timespec *wait, int64_t nsec,
+			int retime)
+{
+    int64_t t;
+
+      // only a wait for bytes changes with the rate
+    t = (int64_t) wait->tv_sec * 1000000000 + wait->tv_nsec;
+    if (nsec > t)
+	return time_wait(s,nsec,0);
+    return time_wait(s,t,retime);
+}
+
+int64_t
+RateLimiter::take_op(int64_t *next, int count, int64_t bound, int64_t *tail)
+{
+    struct timespec t;
+    int64_t step, now, old, start;
+
+      // an operation may start at its own time on the operation
+      // timeline, which is updated without a lock, unless that time
+      // is further off than the bound; a batch takes a run of times,
+      // and waits for the last of them
+    step = __atomic_load_n(&opstep_,__ATOMIC_RELAXED) * count;
+    if (step <= 0)
+	return 0;
+    clock_gettime(CLOCK_REALTIME,&t);
+    now = (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+    old = __atomic_load_n(next,__ATOMIC_RELAXED);
+    do {
+	start = (old > now) ? old : now;
+	if (bound >= 0 && start - now > bound)
+	    return -1;
+    } while (!__atomic_compare_exchange_n(next,&old,start + step,1,
+					  __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+    *tail = start + step;
+    return start + step - step / count - now;
+}
+
+int
+RateLimiter::refuse(int s, size_t size, int op, int64_t optail, int error)
+{
+    int64_t step;
+
+      // give back the bytes taken from the lease, and from the
+      // socket's cap if it was charged
+    if (lease_)
+	lease_->give(size);
+    if (s >= 0 && capped_)
+	give_cap(s,size);
+
+      // give back the operations, if no one has taken a later one
+    step = __atomic_load_n(&opstep_,__ATOMIC_RELAXED);
+    if (optail && step > 0)
+	__atomic_compare_exchange_n(&sendop_,&optail,optail - step * op,0,
+				    __ATOMIC_RELAXED,__ATOMIC_RELAXED);
+    errno = error;
+    return -1;
+}
@@ -4,9 +4,30 @@
 #ifndef rate_limiter_h
 #define rate_limiter_h
 
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <time.h>
 
+#include <map>
+#include <vector>
+
+#include "bottleneck.h"
+#include "delayline.h"
+
+class ConcurrencyLimit;
+class FairQueue;
+class GcraEngine;
+class LeaseBudget;
+class Priority;
+class LeaseSource;
+class Scheduler;
+class ShardedBudget;
+class SharedTimeline;
+class Trace;
+class ZeroCopy;
+
 // This rate limiter will limit the overall rate at which the
 // application sends data.  The rate is given in kilobits per second.
 // We approximate this rate by scheduling a future time to send the
@@ -18,10 +39,35 @@
 // will send 100 bytes at a time, resulting in a smoother rate when the
 // data is bursty.
 
+// Instead of a constant rate, the limiter can replay a recorded
+// bandwidth trace for each direction; see trace.h for the formats.
+// Each direction may also add a propagation delay with jitter; see
+// delayline.h.  Sending may be limited by an emulated bottleneck queue
+// that drops data under overload; see bottleneck.h.
+
+// Instead of pacing each chunk to the end of its own time, the limiter
+// can admit data with the generic cell rate algorithm, which lets a
+// burst go at once and needs no lock; see gcra.h.
+
+// To cut contention, each thread may lease a slice of the sending
+// timeline and spend it without taking the lock for every chunk, or
+// the budget may be split into per-CPU shards; see shard.h.
+
+// Processes can share one budget by keeping the limiter's timelines in
+// shared memory; see shared.h.  Nodes can share a fleet-wide budget by
+// sending against leases from a coordinator; see lease.h.
+
+// Features that keep state of their own, such as the concurrency
+// limit, are set up before the limiter paces its first call.  Once it
+// has, they cannot be turned on, off or changed, since calls in
+// flight may still be using them.
+
 // This rate limiter doesn't tend to work well for speeds higher than 1 Mbps.
 
 class RateLimiter {
  public:
+    enum { PACER, GCRA };
+
       // Initialize with a rate in kilobits per second (kbps) and an optional
       // max burst size (maximum bytes to send at one time).  If no
       // rate is set, then the default is unlimited.
@@ -30,18 +76,238 @@ class RateLimiter {
     RateLimiter(int,int);
     ~RateLimiter();
 
-      // Set the rate in kbps.
-    inline void set_rate(int r) { rate_ = 1000*r; }
-    inline void set_rate(int r, int m) { rate_ = 1000*r; maxburst_ = m;}
+      // Set the rate in kbps.  Calls already waiting for their time
+      // have what is left of their wait re-timed for the new rate.
+    void set_rate(int);
+    void set_rate(int,int);
+
+      // Wake every call waiting in the limiter and make it fail with
+      // ECANCELED, as will every call that would wait from now on.  A
+      // receive that already has its data returns it without waiting.
+      // The destructor stops the limiter and waits for its waiting
+      // calls to leave.
+    void stop();
+
+      // Wake the calls waiting to send or receive on a socket and make
+      // them fail the same way.  Later calls on the socket wait as
+      // usual.
+    void cancel(int);
+
+      // Also limit the number of operations per second in each
+      // direction, where an operation is one call, however many bytes
+      // it moves.  A call waits for both its operation and its bytes,
+      // in one sleep.  A rate of 0 turns the limit off.
+    void set_op_rate(int);
+
+      // Bound the number of calls in flight at once, starting at the
+      // given bound and never going above the maximum, or without a
+      // maximum if it is 0.  The bound adapts to the latency of sends,
+      // the time the socket calls take without the waits for their
+      // turn; see concurrency.h.  A call that finds no room waits, or
+      // fails with EAGAIN if given MSG_DONTWAIT.  A bound of 0 turns
+      // the limit off.  Returns 0 on success, otherwise -1 and errno
+      // is set to EBUSY once the limiter has paced a call.
+    int set_concurrency(int,int);
+
+      // Get the current bound on calls in flight, or 0 if there is
+      // none.
+    int get_concurrency();
+
+      // Share the sending rate fairly between sockets, instead of in
+      // whatever order threads get the lock.  Each socket gets a share
+      // in proportion to its weight, which is 1 unless set otherwise;
+      // setting a weight turns fair sharing on.  See fairqueue.h.
+      // Fair sharing only applies when the limiter paces with its own
+      // lock, and not with the bottleneck queue.  Both return 0 on
+      // success, otherwise -1 and errno is set to EBUSY once the
+      // limiter has paced a call; set_weight() can still change the
+      // weights once fair sharing is on.
+    int set_fair(int);
+    int set_weight(int,int);
+
+      // Divide the sending rate between a number of strict-priority
+      // traffic classes, numbered from 0, the highest; see priority.h.
+      // Sockets are in the lowest class unless set otherwise.  A class
+      // can be guaranteed a share of the rate between 0 and 1, so that
+      // it is not starved.  Traffic classes only apply when the limiter
+      // paces with its own lock.  0 classes turns them off.
+    void set_classes(int);
+    void set_guarantee(int,double);
+    void set_class(int,int);
+
+      // Get Jain's fairness index of the weighted shares the sockets
+      // got since the last call, from 1/n for n sockets up to 1.
+    double get_fairness();
+
+      // Cap the sending rate of one socket in kbps, on top of the
+      // limiter's own rate.  With offload on, a cap on a TCP socket is
+      // handed to the kernel with SO_MAX_PACING_RATE, and the kernel
+      // paces the socket itself; otherwise the limiter paces it.
+      // Returns 1 if the kernel paces the socket and 0 if the limiter
+      // does.  A rate of 0 removes the cap.
+    int set_socket_rate(int,int);
+
+      // Turn offloading of socket caps to the kernel on or off, moving
+      // the caps already set.  When nothing else is limited, sends on
+      // a socket the kernel paces go straight to the system call.
+    void set_offload(int);
+
+      // Send chunks of at least the given size in bytes with
+      // MSG_ZEROCOPY, so the kernel does not copy them; see
+      // zerocopy.h.  A send then returns only once the kernel is done
+      // with the caller's buffer.  Chunks are at most the max burst
+      // size, so zero-copy only pays with a large burst.  Not used
+      // with a delay line, which copies the data, nor by a call that
+      // must not block.  A send cancelled or stopped while it waits
+      // for the kernel returns before its buffer is free.  A size of
+      // 0 turns zero-copy off.  Returns 0 on success, otherwise -1 and
+      // errno is set to EBUSY once the limiter has paced a call.
+    int set_zerocopy(size_t);
+
+      // Bound how long a send may wait for its turn, in microseconds.
+      // A chunk that would wait longer is not sent and nothing is
+      // charged for it; the call fails with ETIMEDOUT, or returns the
+      // number of bytes sent before that chunk.  A send given
+      // MSG_DONTWAIT is bound to no wait at all and fails with EAGAIN.
+      // The time to send the chunk itself does not count.  A bound of
+      // 0 turns it off.
+    void set_max_delay(int);
+
+      // Choose how data is paced: PACER, the default, which waits for
+      // the end of each chunk's time, or GCRA, which admits a chunk as
+      // long as the flow is less than one burst ahead of the rate and
+      // takes no lock.  Traces, the bottleneck queue and shared
+      // timelines are always paced.  Returns 0 on success, otherwise -1
+      // and errno is set to EBUSY once the limiter has paced a call.
+    int set_algorithm(int);
 
       // Get the current rate in bps.
     inline int get_rate() { return rate_; }
 
+      // Get how long, in microseconds, before a send on a socket could
+      // start without waiting for the limiter, so that a caller using
+      // MSG_DONTWAIT knows when to try again.  Returns 0 if it could
+      // start now.  Whether the socket itself has room is up to the
+      // caller to find out, with poll() or the like.  Asking does not
+      // count as pacing a call, so settings can still be changed.
+    int get_wait(int);
+
+      // Send or receive at most one burst without sleeping, for an
+      // event loop that waits on many sockets at once; see reactor.h.
+      // A call whose turn has come moves its data at once, and sets
+      // the time at which its wait would have ended, before which the
+      // socket should not be used again.  A call whose turn has not
+      // come fails with EAGAIN, and sets the time at which it will.
+      // The time is zero when there is nothing to wait for.  Return
+      // the same as the socket calls with MSG_DONTWAIT.  Fair sharing
+      // and zero-copy are not used, and a send whose fleet-wide lease
+      // has run out fails with EAGAIN until the lease is renewed.
+    ssize_t send_now(int,const void*,size_t,int,struct timespec*);
+    ssize_t recv_now(int,void*,size_t,int,struct timespec*);
+
+      // Replay a bandwidth trace file when sending or receiving,
+      // instead of using the configured rate.  A NULL path goes back
+      // to the configured rate.  Returns 0 on success, otherwise -1
+      // and errno is set to indicate the exact error.
+    int set_send_trace(const char*);
+    int set_recv_trace(const char*);
+
+      // Add a one-way delay and jitter in microseconds when sending or
+      // receiving, with the jitter distribution given by DelayLine.
+    void set_send_delay(int,int=0,int=DelayLine::UNIFORM);
+    void set_recv_delay(int,int=0,int=DelayLine::UNIFORM);
+
+      // Emulate a bottleneck queue of the given size in bytes when
+      // sending, with a drop policy given by Bottleneck.  A dropped
+      // chunk makes send() return the bytes sent so far, or -1 with
+      // errno set to ENOBUFS.  A size of 0 removes the queue.
+    void set_queue(int,size_t);
+
+      // Get the number of chunks dropped by the bottleneck queue.
+    unsigned long get_drops();
+
+      // Share one budget with every process that uses the same name,
+      // by keeping the timelines in a named shared memory segment.
+      // The first process sets the shared rate, and the others adopt
+      // it; set_rate() then changes it for all of them.  Traces and
+      // the bottleneck queue are per process and are not used.
+      // Returns 0 on success, otherwise -1 and errno is set to
+      // indicate the exact error, or to EBUSY once the limiter has
+      // paced a call.
+    int share(const char*);
+
+      // Carry the limiter's state over to a process taking over from
+      // this one, so that enforcement goes on across an upgrade
+      // instead of starting again with no debt.  The state is the
+      // sending and receiving timelines and their credit, the
+      // operation timelines, the state of the cell rate algorithm,
+      // and the cap and timeline of each socket, which is known by its
+      // descriptor.  Configuration is not carried over; the successor
+      // sets up its rate and the rest as usual before restoring.
+      // Shared timelines already outlive the process, and sharded
+      // budgets and thread slices start afresh.  The state is in a
+      // versioned format, in the byte order of the host.
+
+      // Save the state to a file, written through a memory mapping to
+      // a new file that is renamed into place, or restore it from one.
+      // A cap the kernel paced is handed to the kernel again if this
+      // limiter offloads caps.  Returns 0 on success, otherwise -1 and
+      // errno is set to indicate the exact error.
+    int save(const char*);
+    int restore(const char*);
+
+      // Hand the state to a successor over a connected Unix stream
+      // socket, or take it over from a predecessor.  Returns 0 on
+      // success, otherwise -1 and errno is set to indicate the exact
+      // error.
+    int hand_off(int);
+    int take_over(int);
+
+      // Also limit sending to leases of the given size in bytes from a
+      // coordinator, pacing at the fallback rate in kbps while it
+      // cannot be reached.  A send waiting for a renewal is bounded by
+      // MSG_DONTWAIT and the maximum delay, and fails as any other
+      // wait does when the limiter is stopped.  The source must
+      // outlive the limiter.  A NULL source removes the limit.  Returns 0 on success, otherwise
+      // -1 and errno is set to EBUSY once the limiter has paced a call.
+    int set_lease(LeaseSource*,size_t,int);
+
+      // Let each sending thread lease a slice of the timeline of the
+      // given length in microseconds, and send from it without taking
+      // the lock.  A slice belongs to one thread, so the rate is never
+      // exceeded, but up to one slice per thread may go unused when a
+      // thread goes idle.  Not used with traces, the bottleneck queue,
+      // or shared timelines.  A length of 0 turns leasing off.
+    void set_thread_lease(int);
+
+      // Split the budget into shards, one per CPU or per NUMA node,
+      // as ShardedBudget::CPU or ShardedBudget::NODE, so that threads
+      // on different CPUs do not contend.  A mode of 0 turns sharding
+      // off.  Traces and the bottleneck queue need a single timeline,
+      // so a direction that uses them is not sharded.  Returns 0 on
+      // success, otherwise -1 and errno is set to EBUSY once the
+      // limiter has paced a call.
+    int set_shards(int);
+
+      // Serve every wait from one scheduler thread with a single timer,
+      // instead of each waiting thread arming a timer of its own, and
+      // wake waiters in the order of their deadlines; see scheduler.h.
+      // Turning it off leaves the thread idle until the limiter is
+      // destroyed.
+    void set_scheduler(int);
+
       // Send at the configured rate.  Return the number of characters
       // sent on success, otherwise -1 and errno is set to indicate
-      // the exact error.
+      // the exact error.  A non-blocking socket that fills up, or an
+      // error after some data went, ends the call early with the
+      // number sent; the rest is not charged.  A datagram is never
+      // split into bursts.
     size_t send(int,const void*,size_t,int);
 
+      // Send in a traffic class, as Priority::BYPASS, or a class set
+      // with set_classes(), or Priority::SOCKET for the socket's own.
+    size_t send(int,const void*,size_t,int,int);
+
       // Receive at the configured rate.  Return number of characters
       // received on success, otherwise -1 and errno is set to indicate
       // the exact error.
@@ -49,17 +315,145 @@ class RateLimiter {
 
       // Send a file over a socket.  Returns the number of characters
       // sent on success, otherwise -1 and errno is set to indicate
-      // the exact error.  Ignores the offset.
+      // the exact error.  As with the socket call, a given offset is
+      // read from and updated, leaving the file position alone.
     ssize_t sendfile(int, int,off_t*,size_t);
+
+      // Send or receive a message, paced as a whole.  Return the same
+      // as the socket calls.  With a delay line, ancillary data cannot
+      // be sent and is not received.
+    ssize_t sendmsg(int,const struct msghdr*,int);
+    ssize_t recvmsg(int,struct msghdr*,int);
+
+      // Send or receive a batch of datagrams in as few system calls as
+      // possible.  Messages are never split: sending groups whole
+      // messages into bursts, each paced with one reservation, and a
+      // message bigger than a burst goes on its own.  Each message is
+      // one operation, so set_op_rate() caps packets per second.
+      // Return the same as the socket calls.  With a delay line, the
+      // messages go one at a time through sendmsg() and recvmsg().
+    int sendmmsg(int,struct mmsghdr*,unsigned int,int);
+    int recvmmsg(int,struct mmsghdr*,unsigned int,int,struct timespec*);
+
+      // Move data between a pipe and a socket, paced like send() when
+      // writing to a socket and like recv() when reading from one.
+      // Moves at most one burst per call when writing to a socket.
+    ssize_t splice(int,loff_t*,int,loff_t*,size_t,unsigned int);
+
+      // Relay up to a number of bytes from one socket to another,
+      // paced like send() on the outgoing socket.  The data moves with
+      // splice() through a pipe kept by each thread, and is never
+      // copied into user space or charged twice.  Returns when the
+      // incoming socket has no more data ready, with the number of
+      // bytes relayed, 0 at the end of the incoming data, or -1 and
+      // errno is set to indicate the exact error.  MSG_DONTWAIT is
+      // used for reading and for pacing, but what was read is always
+      // written in full.  With a delay line, the data is copied through
+      // a buffer, but is still paid for before it is read.
+    ssize_t relay(int,int,size_t,int);
+
+      // Read or write a file or block device, so that a background job
+      // cannot take all of a disk.  A write waits for its turn like a
+      // send, and a read pays once it has its data, like a receive.
+      // Data moves in chunks of the max burst size, rounded down to
+      // whole blocks of the file, or one block if the burst is
+      // smaller, so the chunks of an O_DIRECT transfer stay aligned if
+      // the first one is.  Each chunk is one operation, so
+      // set_op_rate() caps I/O operations per second while the rate
+      // caps bandwidth.  Return the same as the system calls, or the
+      // number of bytes moved before an error or a refused wait.  As
+      // with the system calls, pread() and pwrite() leave the file
+      // position alone.
+    ssize_t read(int,void*,size_t);
+    ssize_t write(int,const void*,size_t);
+    ssize_t pread(int,void*,size_t,off_t);
+    ssize_t pwrite(int,const void*,size_t,off_t);
+
+      // Close a socket.  Data still held in a delay line is sent
+      // before the socket is closed.  Returns 0 on success, otherwise
+      // -1 and errno is set to indicate the exact error.
+    int close(int);
 		
  private:
-    size_t sendall(int,char*,size_t,int);
+    inline int shaping_send() {
+	return rate_ || sendtrace_ || senddelay_ || shared_ || lease_ ||
+	    opstep_ || concurrency_ || capped_;
+    }
+    inline int shaping_recv() {
+	return rate_ || recvtrace_ || recvdelay_ || shared_ || opstep_ ||
+	    concurrency_;
+    }
+    inline int slicing() {
+	return slice_ > 0 && !sendtrace_ && !queue_ && !shared_ && !shards_ &&
+	    !sendgcra_;
+    }
+    inline int sharded_send() {
+	return shards_ && !sendtrace_ && !queue_ && !shared_ && !sendgcra_;
+    }
+    inline int sharded_recv() {
+	return shards_ && !recvtrace_ && !shared_ && !recvgcra_;
+    }
+    inline int fairing() {
+	return fair_ && !queue_;
+    }
+    inline int gcra_send() {
+	return sendgcra_ && !sendtrace_ && !queue_ && !shared_;
+    }
+    inline int gcra_recv() {
+	return recvgcra_ && !recvtrace_ && !shared_;
+    }
+    inline void start() {
+	if (!__atomic_load_n(&started_,__ATOMIC_RELAXED))
+	    __atomic_store_n(&started_,1,__ATOMIC_SEQ_CST);
+    }
+
+    struct inflight;
+    struct slice;
+    struct relaypipe;
+    static void slice_done(void*);
+    static void pipe_done(void*);
+    struct relaypipe *relay_pipe();
+    ssize_t relay_drain(struct relaypipe*,int,size_t);
+    ssize_t fileio(int,char*,size_t,off_t*,int);
+
+      // a socket's own cap, paced here or by the kernel
+    struct cap {
+	int64_t rate;
+	int64_t next;
+	int kernel;
+    };
+    int offload(int,int64_t);
+    int64_t take_cap(int,size_t,int64_t);
+    void give_cap(int,size_t);
+
+    void wake();
+    int cancelled(int,unsigned int);
+
+    void init(int,int);
+    void set_delay(DelayLine**,int,int,int);
+    size_t sendchunks(int,const void*,size_t,int,int,int);
+    int pace_send(int,size_t,int,int,int);
+    int pace_slice(size_t,int64_t,struct timespec*);
+    int64_t take_op(int64_t*,int,int64_t,int64_t*);
+    int refuse(int,size_t,int,int64_t,int);
+    void sent(struct timespec*,struct timespec*);
+    void unsent(int,size_t);
+    int pace_recv(int,size_t,int,struct timespec*,struct timespec*);
+    int datagram(int);
+    int64_t delay(int,int);
+    void pack(std::vector<char>&);
+    int unpack(const char*,size_t);
+    int set_trace(Trace**,const char*);
+    double transmit_time(Trace*,struct timespec*,struct timespec*,size_t);
+    ssize_t sendall(int,char*,size_t,int);
 
     void time_set(struct timespec*,struct timespec*);
     void time_add(struct timespec*,double);
     int time_less(struct timespec*,struct timespec*);
     void time_diff(struct timespec*,struct timespec*,struct timespec*);
     double time_diff2(struct timespec*,struct timespec*);
+    int time_wait(int,int64_t,int);
+    int time_pause(int,struct timespec*,int64_t,int);
 
     pthread_mutex_t mutex_;
     struct timespec send_;
@@ -68,6 +462,44 @@ class RateLimiter {
     double recvextra_;
     int rate_;
     int maxburst_;
+    Trace *sendtrace_;
+    Trace *recvtrace_;
+    DelayLine *senddelay_;
+    DelayLine *recvdelay_;
+    Bottleneck *queue_;
+    SharedTimeline *shared_;
+    ShardedBudget *shards_;
+    GcraEngine *sendgcra_;
+    GcraEngine *recvgcra_;
+    ConcurrencyLimit *concurrency_;
+    FairQueue *fair_;
+    Priority *priority_;
+    int64_t maxdelay_;
+    int64_t opstep_;
+    int64_t sendop_;
+    int64_t recvop_;
+    std::map<int,cap> caps_;
+    int capped_;
+    int offload_;
+    ZeroCopy *zerocopy_;
+    size_t zcmin_;
+    LeaseBudget *lease_;
+    double slice_;
+    int slicing_;
+    pthread_key_t slicekey_;
+    struct slice *slices_;
+    int piping_;
+    pthread_key_t pipekey_;
+    struct relaypipe *pipes_;
+
+    pthread_mutex_t waitlock_;
+    unsigned int gen_;
+    int waiters_;
+    int stopped_;
+    int started_;
+    std::map<int,unsigned int> cancels_;
+    Scheduler *scheduler_;
+    int scheduling_;
 };
 
 #endif /*rate_limiter_h*/
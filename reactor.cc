@@ -0,0 +1,324 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "ratelimiter.h"
+#include "reactor.h"
+
+using namespace std;
+
+Reactor::Reactor(RateLimiter *limiter)
+{
+    struct epoll_event ev;
+
+    limiter_ = limiter;
+    armed_ = 0;
+    seq_ = 0;
+    round_ = 0;
+    trying_[0] = trying_[1] = -1;
+    tried_[0] = tried_[1] = 0;
+    turn_[0] = turn_[1] = 0;
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_ = timerfd_create(CLOCK_REALTIME,TFD_NONBLOCK|TFD_CLOEXEC);
+
+      // the timer is told apart from the sockets by its descriptor
+    if (epfd_ >= 0 && timer_ >= 0) {
+	ev.events = EPOLLIN;
+	ev.data.fd = timer_;
+	epoll_ctl(epfd_,EPOLL_CTL_ADD,timer_,&ev);
+    }
+}
+
+Reactor::~Reactor()
+{
+    if (timer_ >= 0)
+	close(timer_);
+    if (epfd_ >= 0)
+	close(epfd_);
+}
+
+int
+Reactor::add(int fd, struct epoll_event *event)
+{
+    struct epoll_event ev;
+    sock sk;
+
+    if (fd == timer_) {
+	errno = EEXIST;
+	return -1;
+    }
+    ev.events = event->events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_,EPOLL_CTL_ADD,fd,&ev) < 0)
+	return -1;
+    sk.events = event->events;
+    sk.data = event->data;
+    sk.held = 0;
+    sk.out = 0;
+    sk.in = 0;
+    sockets_[fd] = sk;
+    return 0;
+}
+
+int
+Reactor::modify(int fd, struct epoll_event *event)
+{
+    map<int,sock>::iterator i;
+
+    i = sockets_.find(fd);
+    if (i == sockets_.end()) {
+	errno = ENOENT;
+	return -1;
+    }
+    i->second.events = event->events;
+    i->second.data = event->data;
+    return update(fd,&i->second);
+}
+
+int
+Reactor::remove(int fd)
+{
+    if (trying_[0] == fd)
+	trying_[0] = -1;
+    if (trying_[1] == fd)
+	trying_[1] = -1;
+    if (sockets_.erase(fd) == 0) {
+	errno = ENOENT;
+	return -1;
+    }
+    return epoll_ctl(epfd_,EPOLL_CTL_DEL,fd,NULL);
+}
+
+int
+Reactor::update(int fd, sock *sk)
+{
+    struct epoll_event ev;
+
+      // the socket waits for what it asked for, less what is held back
+    ev.events = sk->events & ~sk->held;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd_,EPOLL_CTL_MOD,fd,&ev);
+}
+
+int
+Reactor::wait(struct epoll_event *events, int max, int timeout)
+{
+    map<int,sock>::iterator i;
+    struct timespec now, end;
+    int n, j, d, count, left;
+
+      // a socket let go a pass ago has had its chance to try its turn
+    round_++;
+    for (d = 0; d < 2; d++) {
+	if (trying_[d] >= 0 && round_ - tried_[d] >= 2) {
+	    trying_[d] = -1;
+	    arm();
+	}
+    }
+
+    if (timeout > 0) {
+	clock_gettime(CLOCK_REALTIME,&end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (long) (timeout % 1000) * 1000000;
+	if (end.tv_nsec >= 1000000000) {
+	    end.tv_sec++;
+	    end.tv_nsec -= 1000000000;
+	}
+    }
+    left = timeout;
+    while (1) {
+	n = epoll_wait(epfd_,events,max,left);
+	if (n <= 0)
+	    return n;
+
+	  // hand back the events of the sockets, in place, and let go of
+	  // the sockets whose turn has come
+	count = 0;
+	for (j = 0; j < n; j++) {
+	    if (events[j].data.fd == timer_) {
+		release();
+		continue;
+	    }
+	    i = sockets_.find(events[j].data.fd);
+	    if (i == sockets_.end())
+		continue;
+	    events[count].events = events[j].events;
+	    events[count].data = i->second.data;
+	    count++;
+	}
+	if (count > 0 || timeout == 0)
+	    return count;
+
+	  // only the timer went off, so wait for what is left
+	if (timeout > 0) {
+	    clock_gettime(CLOCK_REALTIME,&now);
+	    left = (end.tv_sec - now.tv_sec) * 1000 +
+		(end.tv_nsec - now.tv_nsec) / 1000000;
+	    if (left <= 0)
+		return 0;
+	}
+    }
+}
+
+ssize_t
+Reactor::send(int s, const void *buf, size_t len, int flags)
+{
+    struct timespec until;
+    ssize_t result;
+    int error;
+
+    result = limiter_->send_now(s,buf,len,flags,&until);
+    error = errno;
+    defer(s,EPOLLOUT,&until,result < 0 && error == EAGAIN);
+    errno = error;
+    return result;
+}
+
+ssize_t
+Reactor::recv(int s, void *buf, size_t len, int flags)
+{
+    struct timespec until;
+    ssize_t result;
+    int error;
+
+    result = limiter_->recv_now(s,buf,len,flags,&until);
+    error = errno;
+    defer(s,EPOLLIN,&until,result < 0 && error == EAGAIN);
+    errno = error;
+    return result;
+}
+
+void
+Reactor::defer(int s, uint32_t event, struct timespec *until, int refused)
+{
+    map<int,sock>::iterator i;
+    struct timespec now;
+    hold h;
+    int d;
+
+      // the socket trying its turn has tried it; if it was turned away,
+      // the others wait for the turn it was given
+    d = (event == EPOLLOUT) ? 0 : 1;
+    h.until = (int64_t) until->tv_sec * 1000000000 + until->tv_nsec;
+    if (trying_[d] == s) {
+	trying_[d] = -1;
+	if (refused && h.until > turn_[d])
+	    turn_[d] = h.until;
+    }
+    clock_gettime(CLOCK_REALTIME,&now);
+    i = sockets_.find(s);
+    if (h.until <= (int64_t) now.tv_sec * 1000000000 + now.tv_nsec ||
+	i == sockets_.end() || !(i->second.events & event)) {
+	arm();
+	return;
+    }
+
+      // hold the event back until the socket's turn; a later turn
+      // replaces an earlier one, whose hold is then ignored
+    if (event == EPOLLOUT)
+	i->second.out = h.until;
+    else
+	i->second.in = h.until;
+    if (!(i->second.held & event)) {
+	i->second.held |= event;
+	update(s,&i->second);
+    }
+    h.seq = seq_++;
+    h.fd = s;
+    h.event = event;
+    if (refused)
+	refused_[d].push(h);
+    else
+	holds_.push(h);
+    arm();
+}
+
+int
+Reactor::stale(const hold &h)
+{
+    map<int,sock>::iterator i;
+
+      // the socket is gone, or was let go, or has a later turn
+    i = sockets_.find(h.fd);
+    return i == sockets_.end() || !(i->second.held & h.event) ||
+	(h.event == EPOLLOUT ? i->second.out : i->second.in) != h.until;
+}
+
+void
+Reactor::let_go(const hold &h)
+{
+    sock *sk;
+
+    sk = &sockets_[h.fd];
+    sk->held &= ~h.event;
+    update(h.fd,sk);
+}
+
+void
+Reactor::release()
+{
+    struct timespec now;
+    uint64_t expirations;
+    int64_t t;
+    int d;
+
+    while (read(timer_,&expirations,sizeof(expirations)) < 0 &&
+	   errno == EINTR)
+	;
+
+      // put back the events of every socket whose own wait is over
+    clock_gettime(CLOCK_REALTIME,&now);
+    t = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    while (!holds_.empty() && holds_.top().until <= t) {
+	if (!stale(holds_.top()))
+	    let_go(holds_.top());
+	holds_.pop();
+    }
+
+      // and let one socket that was turned away try its turn
+    for (d = 0; d < 2; d++) {
+	if (trying_[d] >= 0 || turn_[d] > t)
+	    continue;
+	while (!refused_[d].empty() && stale(refused_[d].top()))
+	    refused_[d].pop();
+	if (refused_[d].empty() || refused_[d].top().until > t)
+	    continue;
+	let_go(refused_[d].top());
+	trying_[d] = refused_[d].top().fd;
+	tried_[d] = round_;
+	refused_[d].pop();
+    }
+    armed_ = 0;
+    arm();
+}
+
+void
+Reactor::arm()
+{
+    struct itimerspec its;
+    int64_t next, t;
+    int d;
+
+      // the timer is always set for the earliest hold that can end
+    next = holds_.empty() ? 0 : holds_.top().until;
+    for (d = 0; d < 2; d++) {
+	if (trying_[d] >= 0 || refused_[d].empty())
+	    continue;
+	t = refused_[d].top().until;
+	if (t < turn_[d])
+	    t = turn_[d];
+	if (next == 0 || t < next)
+	    next = t;
+    }
+    if (next == 0 || next == armed_)
+	return;
+    armed_ = next;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = next / 1000000000;
+    its.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime(timer_,TFD_TIMER_ABSTIME,&its,NULL);
+}
@@ -0,0 +1,114 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef reactor_h
+#define reactor_h
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <map>
+#include <queue>
+#include <vector>
+
+class RateLimiter;
+
+// A Reactor paces sockets in an epoll loop, so that one thread can
+// enforce a limiter's rates across many connections without ever
+// sleeping in a send or receive.  It sends and receives with the
+// limiter's send_now() and recv_now(), which move data only when the
+// socket's turn has come, and say when its next turn will.  Until
+// then, the reactor takes EPOLLOUT or EPOLLIN out of the socket's
+// interest set, so the socket is not reported ready.  A single timerfd,
+// set for the earliest of these times, puts them back.
+
+// Sockets turned away by a budget they share would all come back at
+// its next turn, and all but one would be turned away again.  So
+// sockets turned away come back one at a time, in the order of their
+// turns and then of their arrival, and the next is let go once the
+// last has tried, or has had a pass of the loop to do so.  If it was
+// turned away again, the rest wait for the turn it was given.
+
+// A Reactor is not thread safe; one thread runs the loop.  Sockets must
+// be non-blocking.
+
+class Reactor {
+ public:
+      // Create a reactor that paces with a limiter, which must outlive
+      // it.
+    Reactor(RateLimiter*);
+    ~Reactor();
+
+      // Add, change or remove a socket, as with epoll_ctl().  The
+      // events and data are reported by wait() as given.  Returns 0 on
+      // success, otherwise -1 and errno is set to indicate the exact
+      // error.
+    int add(int,struct epoll_event*);
+    int modify(int,struct epoll_event*);
+    int remove(int);
+
+      // Wait for events, as with epoll_wait(), in milliseconds.  A
+      // socket held back until its turn is not reported for the
+      // events held.  Returns the number of events, 0 on a timeout, or
+      // -1 and errno is set to indicate the exact error.
+    int wait(struct epoll_event*,int,int);
+
+      // Send or receive at most one burst, holding the socket back
+      // until its next turn.  Return the same as the socket calls on a
+      // non-blocking socket; EAGAIN means either that the socket is
+      // full or that its turn has not come, and either way wait()
+      // reports it when it is worth trying again.
+    ssize_t send(int,const void*,size_t,int);
+    ssize_t recv(int,void*,size_t,int);
+
+ private:
+    struct sock {
+	uint32_t events;
+	epoll_data_t data;
+	uint32_t held;
+	int64_t out;
+	int64_t in;
+    };
+    struct hold {
+	int64_t until;
+	unsigned long seq;
+	int fd;
+	uint32_t event;
+    };
+    struct later {
+	bool operator()(const hold &a, const hold &b) const {
+	    if (a.until != b.until)
+		return a.until > b.until;
+	    return a.seq > b.seq;
+	}
+    };
+    typedef std::priority_queue<hold,std::vector<hold>,later> holds;
+
+    void defer(int,uint32_t,struct timespec*,int);
+    int stale(const hold&);
+    void let_go(const hold&);
+    void release();
+    void arm();
+    int update(int,sock*);
+
+    RateLimiter *limiter_;
+    int epfd_;
+    int timer_;
+    int64_t armed_;
+    unsigned long seq_;
+    unsigned long round_;
+    std::map<int,sock> sockets_;
+
+      // holds that end on their own, and for each direction, holds of
+      // sockets turned away, the socket trying its turn, and when the
+      // next may try
+    holds holds_;
+    holds refused_[2];
+    int trying_[2];
+    unsigned long tried_[2];
+    int64_t turn_[2];
+};
+
+#endif /*reactor_h*/
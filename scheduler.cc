@@ -0,0 +1,161 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+using namespace std;
+
+Scheduler::Scheduler()
+{
+    pthread_mutex_init(&mutex_,NULL);
+    stop_ = 0;
+    armed_ = 0;
+    seq_ = 0;
+    timer_ = timerfd_create(CLOCK_REALTIME,TFD_CLOEXEC);
+    if (timer_ >= 0 && pthread_create(&thread_,NULL,run,this) != 0) {
+	close(timer_);
+	timer_ = -1;
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    struct itimerspec its;
+
+      // a timer set in the past goes off at once and lets the thread
+      // see that it should stop
+    if (timer_ >= 0) {
+	pthread_mutex_lock(&mutex_);
+	stop_ = 1;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = 1;
+	timerfd_settime(timer_,TFD_TIMER_ABSTIME,&its,NULL);
+	pthread_mutex_unlock(&mutex_);
+	pthread_join(thread_,NULL);
+	close(timer_);
+    }
+    wake();
+    pthread_mutex_destroy(&mutex_);
+}
+
+void
+Scheduler::sleep(int64_t deadline, unsigned int *word, unsigned int seen)
+{
+    struct timespec t;
+    waiter w;
+
+    if (timer_ < 0) {
+	t.tv_sec = deadline / 1000000000;
+	t.tv_nsec = deadline % 1000000000;
+	syscall(SYS_futex,word,FUTEX_WAIT_BITSET_PRIVATE|FUTEX_CLOCK_REALTIME,
+		seen,&t,NULL,FUTEX_BITSET_MATCH_ANY);
+	return;
+    }
+
+    w.when = deadline;
+    w.word = 0;
+    w.queued = 1;
+    pthread_mutex_lock(&mutex_);
+    w.seq = seq_++;
+    waiters_.insert(&w);
+    arm();
+    pthread_mutex_unlock(&mutex_);
+
+      // a wake before I was queued shows in the caller's word; one
+      // after shows in mine
+    if (__atomic_load_n(word,__ATOMIC_SEQ_CST) == seen)
+	syscall(SYS_futex,&w.word,FUTEX_WAIT_PRIVATE,0,NULL,NULL,0);
+
+      // the scheduler wakes me while holding the lock, so I am not gone
+      // before it is done with me
+    pthread_mutex_lock(&mutex_);
+    if (w.queued)
+	waiters_.erase(&w);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+Scheduler::wake()
+{
+    pthread_mutex_lock(&mutex_);
+    while (!waiters_.empty()) {
+	release(*waiters_.begin());
+	waiters_.erase(waiters_.begin());
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void
+Scheduler::release(waiter *w)
+{
+    w->queued = 0;
+    __atomic_store_n(&w->word,1,__ATOMIC_SEQ_CST);
+    syscall(SYS_futex,&w->word,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+}
+
+void
+Scheduler::arm()
+{
+    struct itimerspec its;
+    int64_t next;
+
+      // the timer is always set for the earliest deadline; one that
+      // goes off for a waiter already gone does no harm
+    if (waiters_.empty())
+	return;
+    next = (*waiters_.begin())->when;
+    if (next == armed_)
+	return;
+    armed_ = next;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = next / 1000000000;
+    its.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime(timer_,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+void *
+Scheduler::run(void *arg)
+{
+    ((Scheduler *) arg)->serve();
+    return NULL;
+}
+
+void
+Scheduler::serve()
+{
+    struct timespec now;
+    uint64_t expirations;
+    int64_t t;
+
+    while (1) {
+	if (read(timer_,&expirations,sizeof(expirations)) < 0 &&
+	    errno == EINTR)
+	    continue;
+	pthread_mutex_lock(&mutex_);
+	if (stop_) {
+	    pthread_mutex_unlock(&mutex_);
+	    break;
+	}
+
+	  // wake everyone now due, in deadline order
+	clock_gettime(CLOCK_REALTIME,&now);
+	t = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	while (!waiters_.empty() && (*waiters_.begin())->when <= t) {
+	    release(*waiters_.begin());
+	    waiters_.erase(waiters_.begin());
+	}
+	armed_ = 0;
+	arm();
+	pthread_mutex_unlock(&mutex_);
+    }
+}
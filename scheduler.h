@@ -0,0 +1,67 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <set>
+
+// A Scheduler serves the waits of many threads from one thread and one
+// timerfd, instead of each waiting thread arming a kernel timer of its
+// own.  Waiters are kept in order of their deadlines, and ties in the
+// order they came, and the timer is set for the earliest.  When it goes
+// off, the scheduler thread wakes every waiter whose deadline has
+// passed, in deadline order, each with a futex wake on a word of its
+// own.  Waiters due by the time the thread runs are released in one
+// batch, and in the order of their reservations.
+
+// If the timer or the thread cannot be created, each waiter sleeps
+// with a timeout of its own, as it would without a scheduler.
+
+class Scheduler {
+ public:
+    Scheduler();
+    ~Scheduler();
+
+      // Sleep until a deadline in nanoseconds since the epoch, on
+      // CLOCK_REALTIME, or until woken.  A word that no longer has the
+      // value seen means the caller was woken just before sleeping.
+      // May return early; the caller checks its deadline again.
+    void sleep(int64_t,unsigned int*,unsigned int);
+
+      // Wake every sleeper, whatever its deadline.
+    void wake();
+
+ private:
+    struct waiter {
+	int64_t when;
+	unsigned long seq;
+	uint32_t word;
+	int queued;
+    };
+    struct earlier {
+	bool operator()(const waiter *a, const waiter *b) const {
+	    if (a->when != b->when)
+		return a->when < b->when;
+	    return a->seq < b->seq;
+	}
+    };
+
+    static void *run(void*);
+    void serve();
+    void arm();
+    void release(waiter*);
+
+    pthread_mutex_t mutex_;
+    pthread_t thread_;
+    int timer_;
+    int stop_;
+    int64_t armed_;
+    unsigned long seq_;
+    std::set<waiter*,earlier> waiters_;
+};
+
+#endif /*scheduler_h*/
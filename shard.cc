@@ -0,0 +1,294 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shard.h"
+#include "timespec.h"
+
+  // steal from an idle shard once my own is backed up this far
+static const int64_t steal_after = 1000000;
+
+  // how often to rebalance, and the part of the rate that is always
+  // split evenly, so that a quiet shard can still start sending
+static const double rebalance_every = 0.01;
+static const double even_share = 0.1;
+
+  // each shard has a cache line of its own
+struct ShardedBudget::shard {
+    int64_t next[2];
+    int64_t extra[2];
+    int64_t rate;
+    uint64_t used;
+} __attribute__((aligned(64)));
+
+  // the shard a thread last reserved from, and at what rate
+static __thread struct {
+    ShardedBudget *budget;
+    int dir;
+    int shard;
+    int64_t rate;
+} charged;
+
+ShardedBudget::ShardedBudget(int mode, int rate)
+{
+    char path[64];
+    void *mem;
+    FILE *f;
+    int i, n, c, node, first, last;
+
+    mode_ = mode;
+    rate_ = rate;
+    ncpus_ = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpus_ < 1)
+	ncpus_ = 1;
+    node_ = NULL;
+
+      // learn which node each CPU is on; the online nodes are listed
+      // as ranges such as 0-1,4, and may have gaps, so each gets the
+      // next shard in turn
+    nshards_ = ncpus_;
+    if (mode_ == NODE) {
+	node_ = (int *) calloc(ncpus_,sizeof(int));
+	n = 0;
+	if ((f = fopen("/sys/devices/system/node/online","r"))) {
+	    while (fscanf(f,"%d",&first) == 1) {
+		last = first;
+		c = fgetc(f);
+		if (c == '-' && fscanf(f,"%d",&last) == 1)
+		    c = fgetc(f);
+		for (node = first; node <= last; node++, n++) {
+		    for (i = 0; i < ncpus_; i++) {
+			snprintf(path,sizeof(path),
+				 "/sys/devices/system/node/node%d/cpu%d",
+				 node,i);
+			if (access(path,F_OK) == 0)
+			    node_[i] = n;
+		    }
+		}
+		if (c != ',')
+		    break;
+	    }
+	    fclose(f);
+	}
+	nshards_ = (n > 0) ? n : 1;
+    }
+
+    if (posix_memalign(&mem,sizeof(shard),nshards_ * sizeof(shard)) != 0)
+	abort();
+    shards_ = (shard *) mem;
+    memset(shards_,0,nshards_ * sizeof(shard));
+    for (i = 0; i < nshards_; i++)
+	shards_[i].rate = (int64_t) rate_ / nshards_;
+
+    pthread_mutex_init(&mutex_,NULL);
+    pthread_cond_init(&tick_,NULL);
+    stop_ = 0;
+    if (nshards_ > 1)
+	pthread_create(&thread_,NULL,run,this);
+}
+
+ShardedBudget::~ShardedBudget()
+{
+    if (nshards_ > 1) {
+	pthread_mutex_lock(&mutex_);
+	stop_ = 1;
+	pthread_cond_signal(&tick_);
+	pthread_mutex_unlock(&mutex_);
+	pthread_join(thread_,NULL);
+    }
+    pthread_cond_destroy(&tick_);
+    pthread_mutex_destroy(&mutex_);
+    free(shards_);
+    free(node_);
+}
+
+int
+ShardedBudget::shards()
+{
+    return nshards_;
+}
+
+void
+ShardedBudget::set_rate(int rate)
+{
+    int64_t share;
+    int i;
+
+    pthread_mutex_lock(&mutex_);
+    for (i = 0; i < nshards_; i++) {
+	if (rate_ > 0)
+	    share = (int64_t) ((double) shards_[i].rate * rate / rate_);
+	else
+	    share = (int64_t) rate / nshards_;
+	__atomic_store_n(&shards_[i].rate,share,__ATOMIC_RELAXED);
+    }
+    rate_ = rate;
+    pthread_mutex_unlock(&mutex_);
+}
+
+int
+ShardedBudget::mine()
+{
+    int cpu;
+
+    cpu = sched_getcpu();
+    if (cpu < 0)
+	cpu = 0;
+    if (mode_ == NODE)
+	return (cpu < ncpus_) ? node_[cpu] : 0;
+    return cpu % nshards_;
+}
+
+int
+ShardedBudget::reserve(int dir, size_t size, struct timespec *now,
+		       struct timespec *wait, int64_t max)
+{
+    int64_t t, duration, extra, take, next, start, rate;
+    shard *s;
+    int i, j;
+
+    wait->tv_sec = 0;
+    wait->tv_nsec = 0;
+    t = (int64_t) now->tv_sec * 1000000000 + now->tv_nsec;
+    i = mine();
+    s = &shards_[i];
+    __atomic_fetch_add(&s->used,size,__ATOMIC_RELAXED);
+
+      // when my shard is backed up, steal from one that is idle
+    if (nshards_ > 1 &&
+	__atomic_load_n(&s->next[dir],__ATOMIC_RELAXED) > t + steal_after) {
+	for (j = 1; j < nshards_; j++) {
+	    shard *other = &shards_[(i + j) % nshards_];
+	    if (__atomic_load_n(&other->next[dir],__ATOMIC_RELAXED) <= t &&
+		__atomic_load_n(&other->rate,__ATOMIC_RELAXED) > 0) {
+		s = other;
+		break;
+	    }
+	}
+    }
+
+    rate = __atomic_load_n(&s->rate,__ATOMIC_RELAXED);
+    charged.budget = this;
+    charged.dir = dir;
+    charged.shard = s - shards_;
+    charged.rate = rate;
+    if (rate <= 0)
+	return 0;
+    duration = (int64_t) ((double) size * 8 * 1000000000 / rate);
+
+      // use up credit for time already spent transferring data
+    extra = __atomic_load_n(&s->extra[dir],__ATOMIC_RELAXED);
+    do {
+	take = (extra < duration) ? extra : duration;
+	if (take <= 0)
+	    break;
+    } while (!__atomic_compare_exchange_n(&s->extra[dir],&extra,extra - take,
+					  1,__ATOMIC_RELAXED,
+					  __ATOMIC_RELAXED));
+    if (take > 0)
+	duration -= take;
+
+      // get my time and set the next time, unless it is too far off,
+      // in which case the credit goes back
+    next = __atomic_load_n(&s->next[dir],__ATOMIC_RELAXED);
+    do {
+	start = (next > t) ? next : t;
+	if (max >= 0 && start - t > max) {
+	    if (take > 0)
+		__atomic_fetch_add(&s->extra[dir],take,__ATOMIC_RELAXED);
+	    charged.rate = 0;
+	    return -1;
+	}
+    } while (!__atomic_compare_exchange_n(&s->next[dir],&next,start + duration,
+					  1,__ATOMIC_RELAXED,
+					  __ATOMIC_RELAXED));
+
+    t = start + duration - t;
+    wait->tv_sec = t / 1000000000;
+    wait->tv_nsec = t % 1000000000;
+    return 0;
+}
+
+void
+ShardedBudget::credit(int dir, double seconds)
+{
+    int i;
+
+      // the same shard give() would use, so that both kinds of credit
+      // land where the time was charged
+    i = (charged.budget == this && charged.dir == dir) ?
+	charged.shard : mine();
+    __atomic_fetch_add(&shards_[i].extra[dir],
+		       (int64_t) (seconds * 1000000000),__ATOMIC_RELAXED);
+}
+
+void
+ShardedBudget::give(int dir, size_t size)
+{
+      // the rebalancer may since have changed the shard's rate, and the
+      // thread may have moved to another CPU
+    if (charged.budget != this || charged.dir != dir || charged.rate <= 0)
+	return;
+    __atomic_fetch_add(&shards_[charged.shard].extra[dir],
+		       (int64_t) ((double) size * 8 * 1000000000 /
+				  charged.rate),__ATOMIC_RELAXED);
+}
+
+int64_t
+ShardedBudget::delay(int dir, struct timespec *now)
+{
+    int64_t t;
+
+      // only my own shard, though a reserve might steal from another
+    t = __atomic_load_n(&shards_[mine()].next[dir],__ATOMIC_RELAXED) -
+	((int64_t) now->tv_sec * 1000000000 + now->tv_nsec);
+    return t > 0 ? t : 0;
+}
+
+void *
+ShardedBudget::run(void *arg)
+{
+    ((ShardedBudget *) arg)->rebalancer();
+    return NULL;
+}
+
+void
+ShardedBudget::rebalancer()
+{
+    struct timespec when;
+    uint64_t *used, total;
+    int i;
+
+    used = new uint64_t[nshards_];
+    pthread_mutex_lock(&mutex_);
+    while (!stop_) {
+	clock_gettime(CLOCK_REALTIME,&when);
+	timespec_add(&when,rebalance_every);
+	pthread_cond_timedwait(&tick_,&mutex_,&when);
+	if (stop_)
+	    break;
+
+	  // give each shard a share in proportion to its demand; an
+	  // idle limiter keeps the shares it had
+	total = 0;
+	for (i = 0; i < nshards_; i++) {
+	    used[i] = __atomic_exchange_n(&shards_[i].used,0,__ATOMIC_RELAXED);
+	    total += used[i];
+	}
+	if (total == 0)
+	    continue;
+	for (i = 0; i < nshards_; i++)
+	    __atomic_store_n(&shards_[i].rate,
+			     (int64_t) (rate_ * ((1 - even_share) * used[i] /
+						 total +
+						 even_share / nshards_)),
+			     __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&mutex_);
+    delete [] used;
+}
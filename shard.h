@@ -0,0 +1,80 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef shard_h
+#define shard_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// A ShardedBudget splits the rate limiter's budget into shards, one
+// per CPU or one per NUMA node, so that threads on different CPUs do
+// not fight over one cache line.  Each shard has its own timelines,
+// paced at its share of the rate, and the shares always add up to the
+// whole rate.  A thread uses the shard of the CPU it runs on.
+
+// A thread whose shard is backed up steals time from a shard that is
+// idle.  A background thread rebalances the shares every few
+// milliseconds, in proportion to how much each shard was asked for,
+// so the busy shards get most of the rate.
+
+class ShardedBudget {
+ public:
+    enum { SEND, RECV };
+    enum { CPU = 1, NODE };
+
+      // Split a rate in bps into shards, one per CPU or per node.
+    ShardedBudget(int,int);
+    ~ShardedBudget();
+
+      // Get the number of shards.
+    int shards();
+
+      // Set the rate in bps, keeping each shard's share of it.
+    void set_rate(int);
+
+      // Reserve the time to send or receive a number of bytes, given
+      // the current time, and return how long to wait before the
+      // reserved time ends.  Credit given for time already spent
+      // transferring data is used first.  If the reserved time would
+      // start more than the given nanoseconds from now, nothing is
+      // reserved and -1 is returned; a negative bound means none.
+    int reserve(int,size_t,struct timespec*,struct timespec*,
+		int64_t = -1);
+
+      // Credit time in seconds already spent transferring data, to the
+      // shard this thread last reserved from in that direction.
+    void credit(int,double);
+
+      // Give back the time reserved for a number of bytes that were
+      // not sent, to the shard this thread last reserved from, at the
+      // rate it was charged.
+    void give(int,size_t);
+
+      // Get how long from the given time, in nanoseconds, before the
+      // timeline is free.
+    int64_t delay(int,struct timespec*);
+
+ private:
+    struct shard;
+
+    static void *run(void*);
+    void rebalancer();
+    int mine();
+
+    struct shard *shards_;
+    int nshards_;
+    int *node_;
+    int ncpus_;
+    int mode_;
+    int rate_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t tick_;
+    pthread_t thread_;
+    int stop_;
+};
+
+#endif /*shard_h*/
@@ -0,0 +1,179 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+static const uint32_t shared_magic = 0x524c5453;
+static const uint32_t shared_version = 1;
+
+  // each timeline has a cache line of its own, so that senders and
+  // receivers do not contend
+struct timeline {
+    int64_t next;
+    int64_t extra;
+} __attribute__((aligned(64)));
+
+struct SharedTimeline::segment {
+    uint32_t magic;
+    uint32_t version;
+    int32_t owner;
+    int32_t rate;
+    struct timeline line[2];
+};
+
+SharedTimeline::SharedTimeline()
+{
+    seg_ = NULL;
+}
+
+SharedTimeline::~SharedTimeline()
+{
+    if (seg_)
+	munmap(seg_,sizeof(segment));
+}
+
+int
+SharedTimeline::open(const char *name, int rate)
+{
+    struct timespec pause;
+    struct stat st;
+    segment *seg;
+    int32_t owner;
+    int fd;
+
+    fd = shm_open(name,O_RDWR|O_CREAT,0666);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd,&st) < 0 ||
+	(st.st_size < (off_t) sizeof(segment) &&
+	 ftruncate(fd,sizeof(segment)) < 0)) {
+	close(fd);
+	return -1;
+    }
+    seg = (segment *) mmap(NULL,sizeof(segment),PROT_READ|PROT_WRITE,
+			   MAP_SHARED,fd,0);
+    close(fd);
+    if (seg == MAP_FAILED)
+	return -1;
+
+      // initialize the segment, or wait for its owner to do so; take
+      // over if the owner died first
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000000;
+    while (__atomic_load_n(&seg->magic,__ATOMIC_ACQUIRE) != shared_magic) {
+	owner = __atomic_load_n(&seg->owner,__ATOMIC_ACQUIRE);
+	if ((owner == 0 || (kill(owner,0) < 0 && errno == ESRCH)) &&
+	    __atomic_compare_exchange_n(&seg->owner,&owner,getpid(),0,
+					__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+	    seg->version = shared_version;
+	    seg->rate = rate;
+	    seg->line[SEND].next = 0;
+	    seg->line[SEND].extra = 0;
+	    seg->line[RECV].next = 0;
+	    seg->line[RECV].extra = 0;
+	    __atomic_store_n(&seg->magic,shared_magic,__ATOMIC_RELEASE);
+	    break;
+	}
+	nanosleep(&pause,NULL);
+    }
+    if (seg->version != shared_version) {
+	munmap(seg,sizeof(segment));
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (seg_)
+	munmap(seg_,sizeof(segment));
+    seg_ = seg;
+    return 0;
+}
+
+int
+SharedTimeline::remove(const char *name)
+{
+    return shm_unlink(name);
+}
+
+int
+SharedTimeline::get_rate()
+{
+    return __atomic_load_n(&seg_->rate,__ATOMIC_RELAXED);
+}
+
+void
+SharedTimeline::set_rate(int rate)
+{
+    __atomic_store_n(&seg_->rate,rate,__ATOMIC_RELAXED);
+}
+
+int
+SharedTimeline::reserve(int dir, size_t size, struct timespec *now,
+			struct timespec *wait, int64_t max)
+{
+    struct timeline *line = &seg_->line[dir];
+    int64_t t, duration, extra, take, next, start;
+    int32_t rate;
+
+    wait->tv_sec = 0;
+    wait->tv_nsec = 0;
+    rate = __atomic_load_n(&seg_->rate,__ATOMIC_RELAXED);
+    if (rate <= 0)
+	return 0;
+    t = (int64_t) now->tv_sec * 1000000000 + now->tv_nsec;
+    duration = (int64_t) ((double) size * 8 * 1000000000 / rate);
+
+      // use up credit for time already spent transferring data
+    extra = __atomic_load_n(&line->extra,__ATOMIC_RELAXED);
+    do {
+	take = (extra < duration) ? extra : duration;
+	if (take <= 0)
+	    break;
+    } while (!__atomic_compare_exchange_n(&line->extra,&extra,extra - take,
+					  1,__ATOMIC_RELAXED,
+					  __ATOMIC_RELAXED));
+    if (take > 0)
+	duration -= take;
+
+      // get my time and set the next time, unless it is too far off,
+      // in which case the credit goes back
+    next = __atomic_load_n(&line->next,__ATOMIC_RELAXED);
+    do {
+	start = (next > t) ? next : t;
+	if (max >= 0 && start - t > max) {
+	    if (take > 0)
+		__atomic_fetch_add(&line->extra,take,__ATOMIC_RELAXED);
+	    return -1;
+	}
+    } while (!__atomic_compare_exchange_n(&line->next,&next,start + duration,
+					  1,__ATOMIC_RELAXED,
+					  __ATOMIC_RELAXED));
+
+    t = start + duration - t;
+    wait->tv_sec = t / 1000000000;
+    wait->tv_nsec = t % 1000000000;
+    return 0;
+}
+
+void
+SharedTimeline::credit(int dir, double seconds)
+{
+    __atomic_fetch_add(&seg_->line[dir].extra,(int64_t) (seconds * 1000000000),
+		       __ATOMIC_RELAXED);
+}
+
+int64_t
+SharedTimeline::delay(int dir, struct timespec *now)
+{
+    int64_t t;
+
+    t = __atomic_load_n(&seg_->line[dir].next,__ATOMIC_RELAXED) -
+	((int64_t) now->tv_sec * 1000000000 + now->tv_nsec);
+    return t > 0 ? t : 0;
+}
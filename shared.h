@@ -0,0 +1,64 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef shared_h
+#define shared_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// A SharedTimeline keeps the rate limiter's sending and receiving
+// timelines in a named shared memory segment, so that every process
+// that opens the same name draws from one budget.  This suits prefork
+// and multi-process servers, which cannot share a limiter object.
+
+// Each timeline is a single 64-bit word holding the next free time in
+// nanoseconds, and it is updated with a compare-and-swap, so there is
+// no lock for a process to die holding.  A process that dies during
+// an update leaves either the old value or the new one.  The segment
+// is initialized by the process that creates it; if that process dies
+// before finishing, the next process to open the segment takes over.
+
+class SharedTimeline {
+ public:
+    enum { SEND, RECV };
+
+    SharedTimeline();
+    ~SharedTimeline();
+
+      // Open the named segment, creating it with the given rate in bps
+      // if it does not exist.  Returns 0 on success, otherwise -1 and
+      // errno is set to indicate the exact error.
+    int open(const char*,int);
+
+      // Remove a named segment.  Processes that have it open keep it.
+    static int remove(const char*);
+
+      // Get or set the rate in bps shared by all processes.
+    int get_rate();
+    void set_rate(int);
+
+      // Reserve the time to send or receive a number of bytes, given
+      // the current time, and return how long to wait before the
+      // reserved time ends.  Credit given for time already spent
+      // transferring data is used first.  If the reserved time would
+      // start more than the given nanoseconds from now, nothing is
+      // reserved and -1 is returned; a negative bound means none.
+    int reserve(int,size_t,struct timespec*,struct timespec*,
+		int64_t = -1);
+
+      // Credit time in seconds already spent transferring data.
+    void credit(int,double);
+
+      // Get how long from the given time, in nanoseconds, before the
+      // timeline is free.
+    int64_t delay(int,struct timespec*);
+
+ private:
+    struct segment;
+
+    struct segment *seg_;
+};
+
+#endif /*shared_h*/
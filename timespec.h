@@ -0,0 +1,43 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef timespec_h
+#define timespec_h
+
+#include <time.h>
+
+// Arithmetic on CLOCK_REALTIME times, shared by the limiter and the
+// parts that keep times of their own.
+
+  // Is the first time before the second?
+static inline int
+timespec_before(const struct timespec *t1, const struct timespec *t2)
+{
+    return (t1->tv_sec < t2->tv_sec ||
+	    (t1->tv_sec == t2->tv_sec && t1->tv_nsec < t2->tv_nsec));
+}
+
+  // Add a duration in seconds, which may be negative.
+static inline void
+timespec_add(struct timespec *t, double duration)
+{
+    long nsec;
+
+    nsec = t->tv_nsec + (long) (duration * 1000000000);
+    t->tv_sec += nsec / 1000000000;
+    t->tv_nsec = nsec % 1000000000;
+    if (t->tv_nsec < 0) {
+	t->tv_sec -= 1;
+	t->tv_nsec += 1000000000;
+    }
+}
+
+  // Get the seconds from the second time to the first.
+static inline double
+timespec_elapsed(const struct timespec *t1, const struct timespec *t2)
+{
+    return (t1->tv_sec - t2->tv_sec) +
+	(double) (t1->tv_nsec - t2->tv_nsec) / 1000000000;
+}
+
+#endif /*timespec_h*/
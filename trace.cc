@@ -0,0 +1,251 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+  // each delivery opportunity carries one MTU-sized packet
+static const double packet_size = 1500;
+
+Trace::Trace()
+{
+    map_ = NULL;
+    size_ = 0;
+    pos_ = NULL;
+    rates_ = 0;
+    period_ = 0;
+}
+
+Trace::~Trace()
+{
+    if (map_)
+	munmap(map_,size_);
+}
+
+int
+Trace::open(const char *path)
+{
+    struct stat st;
+    double ms, kbps, last, prev, capacity;
+    int fd, lines;
+    char *p;
+
+    fd = ::open(path,O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd,&st) < 0) {
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0) {
+	close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+    p = (char *) mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return -1;
+    madvise(p,st.st_size,MADV_SEQUENTIAL);
+
+    if (map_)
+	munmap(map_,size_);
+    map_ = p;
+    size_ = st.st_size;
+
+      // the first line decides the format
+    pos_ = map_;
+    kbps = -1;
+    if (next_line(&ms,&kbps) < 0)
+	goto invalid;
+    rates_ = (kbps >= 0);
+
+      // check once that the trace makes progress, so that replaying
+      // it can never loop forever
+    pos_ = map_;
+    lines = 0;
+    last = 0;
+    prev = 0;
+    capacity = 0;
+    while (kbps = -1, next_line(&ms,&kbps) == 0) {
+	if (ms < last || (rates_ && kbps < 0))
+	    goto invalid;
+	if (ms > last)
+	    capacity += prev;
+	prev = kbps;
+	last = ms;
+	lines++;
+    }
+    if (!rates_)
+	capacity = lines;
+    if (last <= 0 || capacity <= 0)
+	goto invalid;
+    period_ = last / 1000;
+
+    clock_gettime(CLOCK_REALTIME,&epoch_);
+    base_ = 0;
+    rewind();
+    return 0;
+
+ invalid:
+    munmap(map_,size_);
+    map_ = NULL;
+    size_ = 0;
+    errno = EINVAL;
+    return -1;
+}
+
+double
+Trace::advance(struct timespec *start, size_t len)
+{
+    double t, cur, room, bytes, skip;
+
+    t = (start->tv_sec - epoch_.tv_sec) +
+	(double) (start->tv_nsec - epoch_.tv_nsec) / 1000000000;
+    bytes = len;
+
+      // skip whole periods at once when the link has been idle
+    if (t - when_ > period_) {
+	skip = floor((t - when_) / period_) * period_;
+	base_ += skip;
+	when_ += skip;
+	until_ += skip;
+    }
+
+    if (rates_) {
+	cur = t;
+	while (1) {
+	    if (cur >= until_) {
+		next_slot();
+		continue;
+	    }
+	    if (rate_ > 0) {
+		room = (until_ - cur) * rate_ / 8;
+		if (bytes <= room) {
+		    cur += bytes * 8 / rate_;
+		    break;
+		}
+		bytes -= room;
+	    }
+	    cur = until_;
+	}
+	return cur - t;
+    }
+
+    cur = t;
+    while (bytes > 0) {
+	  // opportunities that passed while idle are lost
+	if (when_ < t) {
+	    next_slot();
+	    continue;
+	}
+	if (bytes < left_) {
+	    left_ -= bytes;
+	    bytes = 0;
+	} else {
+	    bytes -= left_;
+	    left_ = 0;
+	}
+	cur = when_;
+	if (left_ == 0)
+	    next_slot();
+    }
+    return cur - t;
+}
+
+int
+Trace::next_line(double *ms, double *kbps)
+{
+    char *end = map_ + size_;
+    double *field, scale;
+    int n;
+
+      // skip blank lines
+    while (pos_ < end && (*pos_ == ' ' || *pos_ == '\t' ||
+			  *pos_ == '\r' || *pos_ == '\n'))
+	pos_++;
+    if (pos_ == end)
+	return -1;
+
+      // parse up to two numbers on this line; the mapping is not
+      // terminated, so strtod() cannot be used
+    field = ms;
+    for (n = 0; n < 2 && field; n++) {
+	if (pos_ == end || *pos_ < '0' || *pos_ > '9')
+	    break;
+	*field = 0;
+	while (pos_ < end && *pos_ >= '0' && *pos_ <= '9')
+	    *field = *field * 10 + (*pos_++ - '0');
+	if (pos_ < end && *pos_ == '.') {
+	    pos_++;
+	    scale = 0.1;
+	    while (pos_ < end && *pos_ >= '0' && *pos_ <= '9') {
+		*field += scale * (*pos_++ - '0');
+		scale /= 10;
+	    }
+	}
+	while (pos_ < end && (*pos_ == ' ' || *pos_ == '\t'))
+	    pos_++;
+	field = kbps;
+    }
+    if (n == 0)
+	return -1;
+
+      // ignore anything else on the line
+    while (pos_ < end && *pos_ != '\n')
+	pos_++;
+    return 0;
+}
+
+void
+Trace::rewind()
+{
+    double ms, kbps;
+
+    pos_ = map_;
+    next_line(&ms,&kbps);
+    if (rates_) {
+	  // any gap before the first entry carries nothing
+	when_ = base_;
+	until_ = base_ + ms / 1000;
+	rate_ = 0;
+	pending_ = kbps * 1000;
+    } else {
+	when_ = base_ + ms / 1000;
+	left_ = packet_size;
+    }
+}
+
+void
+Trace::next_slot()
+{
+    double ms, kbps;
+
+    if (!rates_) {
+	if (next_line(&ms,&kbps) < 0) {
+	    base_ += period_;
+	    rewind();
+	    return;
+	}
+	when_ = base_ + ms / 1000;
+	left_ = packet_size;
+	return;
+    }
+
+      // the last entry only marks the end of the period
+    if (next_line(&ms,&kbps) < 0) {
+	base_ += period_;
+	rewind();
+	return;
+    }
+    when_ = until_;
+    rate_ = pending_;
+    until_ = base_ + ms / 1000;
+    pending_ = kbps * 1000;
+}
@@ -0,0 +1,67 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef trace_h
+#define trace_h
+
+#include <stddef.h>
+#include <time.h>
+
+// A Trace replays a recorded bandwidth trace so that the rate limiter
+// can emulate a link whose speed varies over time, such as a cellular
+// or Wi-Fi link.  Two file formats are understood:
+
+// 1) Delivery opportunities (the Mahimahi format).  Each line holds a
+// single timestamp in milliseconds, and each line is an opportunity
+// to deliver one 1500-byte packet at that time.  Several lines with
+// the same timestamp deliver several packets in that millisecond.
+
+// 2) Rate series.  Each line holds a timestamp in milliseconds and a
+// rate in kilobits per second, separated by white space.  The rate
+// applies from that timestamp until the next line.
+
+// In both formats the last timestamp marks the end of the trace, and
+// the trace then repeats from the beginning.  The format is chosen by
+// looking at the first line of the file.
+
+// The file is memory-mapped and parsed incrementally, one line at a
+// time, as the link is used.  A Trace is not thread safe; the rate
+// limiter only calls it while holding its own lock.
+
+class Trace {
+ public:
+    Trace();
+    ~Trace();
+
+      // Map a trace file and start replaying it now.  Returns 0 on
+      // success, otherwise -1 and errno is set to indicate the error.
+    int open(const char*);
+
+      // Given the time at which the link becomes free and a number of
+      // bytes, return the time in seconds needed to deliver them.
+      // Opportunities that passed while the link was idle are lost.
+    double advance(struct timespec*,size_t);
+
+ private:
+    int next_line(double*,double*);
+    void rewind();
+    void next_slot();
+
+    char *map_;
+    size_t size_;
+    char *pos_;
+    int rates_;
+
+    struct timespec epoch_;
+    double period_;
+    double base_;
+
+      // current delivery opportunity, or current rate segment
+    double when_;
+    double until_;
+    double left_;
+    double rate_;
+    double pending_;
+};
+
+#endif /*trace_h*/
@@ -0,0 +1,178 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#include <errno.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "zerocopy.h"
+
+using namespace std;
+
+ZeroCopy::ZeroCopy()
+{
+    pthread_mutex_init(&mutex_,NULL);
+}
+
+ZeroCopy::~ZeroCopy()
+{
+    pthread_mutex_destroy(&mutex_);
+}
+
+int
+ZeroCopy::enable(int s)
+{
+    sock *sk;
+    int on, state;
+
+      // turn zero-copy on the first time a socket is used
+    pthread_mutex_lock(&mutex_);
+    sk = &sockets_[s];
+    if (sk->state == UNKNOWN) {
+	on = 1;
+	sk->state = (setsockopt(s,SOL_SOCKET,SO_ZEROCOPY,&on,sizeof(on)) == 0)
+	    ? ON : OFF;
+	sk->sent = 0;
+	sk->done = 0;
+    }
+    state = sk->state;
+    pthread_mutex_unlock(&mutex_);
+    return state == ON;
+}
+
+ssize_t
+ZeroCopy::send(int s, const void *buf, size_t len, int flags)
+{
+    const char *ptr;
+    size_t nleft;
+    ssize_t n;
+    int zerocopy;
+
+    zerocopy = enable(s);
+    ptr = (const char *) buf;
+    nleft = len;
+    while (nleft) {
+	n = ::send(s,ptr,nleft,flags | (zerocopy ? MSG_ZEROCOPY : 0));
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+
+	      // no memory to pin the pages, so copy this time
+	    if (zerocopy && errno == ENOBUFS) {
+		zerocopy = 0;
+		continue;
+	    }
+	    if (nleft == len)
+		return -1;
+	    break;
+	} else if (n == 0) {
+	    break;
+	}
+
+	  // the kernel numbers each zero-copy send that takes data
+	if (zerocopy) {
+	    pthread_mutex_lock(&mutex_);
+	    sockets_[s].sent++;
+	    pthread_mutex_unlock(&mutex_);
+	}
+	nleft -= n;
+	ptr += n;
+    }
+    return len - nleft;
+}
+
+int
+ZeroCopy::reap(int s, int timeout)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+		 CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct sock_extended_err *err;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct pollfd pfd;
+    sock *sk;
+    int pending, error, woken;
+    socklen_t len;
+
+    woken = 0;
+    while (1) {
+	pthread_mutex_lock(&mutex_);
+	sk = &sockets_[s];
+	pending = (int32_t) (sk->sent - sk->done) > 0;
+	pthread_mutex_unlock(&mutex_);
+	if (!pending)
+	    return 0;
+
+	  // each completion covers a range of sends, which complete in
+	  // order
+	memset(&msg,0,sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(s,&msg,MSG_ERRQUEUE) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN || timeout == 0)
+		return (errno == EAGAIN) ? 0 : -1;
+
+	      // POLLERR with nothing on the error queue is an error on the
+	      // socket, or a hang up, and no completion will come of it
+	    if (woken) {
+		error = 0;
+		len = sizeof(error);
+		getsockopt(s,SOL_SOCKET,SO_ERROR,&error,&len);
+		errno = error ? error : EPIPE;
+		return -1;
+	    }
+
+	      // the error queue is ready when poll() says POLLERR
+	    pfd.fd = s;
+	    pfd.events = 0;
+	    switch (poll(&pfd,1,timeout)) {
+	    case -1:
+		if (errno != EINTR)
+		    return -1;
+		continue;
+	    case 0:
+		errno = ETIMEDOUT;
+		return -1;
+	    }
+	    if (pfd.revents & POLLNVAL) {
+		errno = EBADF;
+		return -1;
+	    }
+	    woken = 1;
+	    continue;
+	}
+	woken = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg,cmsg)) {
+	    if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+		  (cmsg->cmsg_level == SOL_IPV6 &&
+		   cmsg->cmsg_type == IPV6_RECVERR)))
+		continue;
+	    err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+	    if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		continue;
+	    pthread_mutex_lock(&mutex_);
+	    sk = &sockets_[s];
+	    if ((int32_t) (err->ee_data + 1 - sk->done) > 0)
+		sk->done = err->ee_data + 1;
+
+	      // copying anyway costs more than copying up front
+	    if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+		sk->state = OFF;
+	    pthread_mutex_unlock(&mutex_);
+	}
+    }
+}
+
+void
+ZeroCopy::forget(int s)
+{
+    pthread_mutex_lock(&mutex_);
+    sockets_.erase(s);
+    pthread_mutex_unlock(&mutex_);
+}
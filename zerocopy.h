@@ -0,0 +1,62 @@
+// RateLimiter by Daniel Zappala, Brigham Young University.
+// This program is licensed under the GPL; see LICENSE for details.
+
+#ifndef zerocopy_h
+#define zerocopy_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+
+// ZeroCopy sends data with MSG_ZEROCOPY, so that the kernel sends from
+// the caller's pages instead of copying them.  The pages belong to the
+// kernel until it says it is done with them, which it does by queueing
+// a completion on the socket's error queue for each zero-copy send.
+// ZeroCopy numbers the sends on each socket and reaps the completions,
+// so that a caller can wait until its buffer is its own again.
+
+// A socket that cannot send without copying, because it does not
+// support SO_ZEROCOPY, or because the kernel reports that it copied
+// the data anyway, as it does over loopback, goes back to plain sends.
+// So does a send that the kernel refuses for lack of memory to pin
+// the pages.
+
+class ZeroCopy {
+ public:
+    ZeroCopy();
+    ~ZeroCopy();
+
+      // Send all of a buffer, without copying it if the socket allows.
+      // Returns the number of bytes sent before an error, or -1 if
+      // none were and errno is set to indicate the exact error.  The
+      // buffer must not be changed until reap() says it is free.
+    ssize_t send(int,const void*,size_t,int);
+
+      // Reap the completions queued on a socket, waiting at most the
+      // given number of milliseconds for every zero-copy send on the
+      // socket to complete, or not at all if it is 0.  Returns 0 once
+      // they have completed, or when told not to wait, otherwise -1
+      // and errno is set to ETIMEDOUT if some are still pending, or to
+      // indicate the exact error.
+    int reap(int,int);
+
+      // Forget a socket, when it is closed.
+    void forget(int);
+
+ private:
+    struct sock {
+	int state;
+	uint32_t sent;
+	uint32_t done;
+    };
+    enum { UNKNOWN, ON, OFF };
+
+    int enable(int);
+
+    pthread_mutex_t mutex_;
+    std::map<int,sock> sockets_;
+};
+
+#endif /*zerocopy_h*/